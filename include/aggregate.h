@@ -0,0 +1,55 @@
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include <limits>
+#include <algorithm>
+
+//aggregates over values kept in b-tree nodes: type, identity, value -> type and associative merge;
+//counted policies keep number of keys of every subtree in its parent for order statistics
+
+template <typename Value>
+struct NoAggregate{
+    struct type{};
+    static const bool enabled = false;
+    static const bool counted = false;
+    static type identity(){ return type(); }
+    static type fromValue(const Value &){ return type(); }
+    static type merge(const type &, const type &){ return type(); }
+};
+
+template <typename Value>
+struct CountAggregate: NoAggregate<Value>{
+    static const bool counted = true;
+};
+
+template <typename Value>
+struct SumAggregate{
+    typedef Value type;
+    static const bool enabled = true;
+    static const bool counted = true;
+    static type identity(){ return Value(); }
+    static type fromValue(const Value &v){ return v; }
+    static type merge(const type &a, const type &b){ return a + b; }
+};
+
+template <typename Value>
+struct MinAggregate{
+    typedef Value type;
+    static const bool enabled = true;
+    static const bool counted = true;
+    static type identity(){ return std::numeric_limits<Value>::max(); }
+    static type fromValue(const Value &v){ return v; }
+    static type merge(const type &a, const type &b){ return std::min(a, b); }
+};
+
+template <typename Value>
+struct MaxAggregate{
+    typedef Value type;
+    static const bool enabled = true;
+    static const bool counted = true;
+    static type identity(){ return std::numeric_limits<Value>::lowest(); }
+    static type fromValue(const Value &v){ return v; }
+    static type merge(const type &a, const type &b){ return std::max(a, b); }
+};
+
+#endif
@@ -3,179 +3,531 @@
 
 #include <fstream>
 #include <vector>
+#include <map>
+#include <set>
 #include <algorithm>
 #include <cstring>
 #include <utility>
+#include <iterator>
 #include <iostream>
+#include <string>
 #include <exception>
 
 #include "cacher.h"
+#include "write-back.h"
 #include "logger.h"
-
-template <typename Key, typename Value, unsigned int min_deg> //min_deg-1 ... 2min_deg-2 keys in node
-class Btree{
+#include "bloom.h"
+#include "aggregate.h"
+#include "frozen-b-tree.h"
+#include "hash-index.h"
+#include "database.h"
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg = NoAggregate<Value> > //min_deg-1 ... 2min_deg-2 keys in node
+class Btree: private TreeBase{
  public:
     static_assert(min_deg >= 2, "Should be at least two children");
 
-    Btree();
-    ~Btree(){}
+    Btree(); //single tree in btree.main, btree.vals and btree.log, kept as database with one tree
+    Btree(Database &db, const char *name); //tree called name among trees of db, created if needed
+    ~Btree();
 
     void addElem(const Key &k, const Value &v);
     void delElem(const Key &k);
     bool findElem(const Key &k, Value *v);
-    void getElems(const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res);
+    //keys of [l, r] in ascending order (descending if reverse), at most limit of them unless limit is 0
+    void getElems(const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res, size_t limit = 0, bool reverse = false);
+    void getKeys(const Key &l, const Key &r, std::vector<Key> &res, size_t limit = 0, bool reverse = false); //no value reads
+
+    //read-modify-write in one descent
+    template <typename F> bool updateElem(const Key &k, F fn); //fn(Value &v), only for existing key
+    template <typename F> void upsert(const Key &k, F fn); //fn(Value &v, bool exists), v is Value() for new key
+    bool insertIfAbsent(const Key &k, const Value &v, Value *existing);
+    bool take(const Key &k, Value *v);
+    unsigned long long delRange(const Key &l, const Key &r); //returns number of deleted keys
+
+    void enableHashIndex(); //key to value offset in btree.hash for findElem, stays on until disabled; not for Database
+    void disableHashIndex();
+    void enableFilter(size_t expected = 0); //bloom filter for negative findElem, kept in btree.bloom or db.tree.bloom
+    void rebuildFilter(size_t expected = 0);
+
+    //order statistics, O(height) node reads if Agg is counted (CountAggregate or an aggregate), otherwise
+    //subtrees inside the range are read whole
+    unsigned long long size();
+    unsigned long long count(const Key &l, const Key &r);
+    unsigned long long rank(const Key &k); //number of keys less than k
+    bool select(unsigned long long i, Key *k, Value *v); //i-th key from 0
+    typename Agg::type aggregate(const Key &l, const Key &r);
+
+    void freeze(const char *name); //writes packed read-only copy for FrozenBtree
+
+    void enableWriteBuffer(size_t max_entries); //sorted buffer in front of tree, kept in btree.wal or db.tree.wal until flush
+    void flushBuffer();
+
+    void setValueCacheSize(size_t bytes); //memory for cached values of btree.vals, 0 turns it off
+    void valueCacheStats(unsigned long long *hits, unsigned long long *misses);
+
+    //deletes rebalance only nodes with less than min_keys keys, others are left underfull until maintain
+    void enableLazyDelete(size_t min_keys = 1);
+    void disableLazyDelete();
+    //rebalances up to max_paths delayed paths (0 for all), returns how many; paths aren't kept across sessions,
+    //so once per session, when no path is left, whole tree is walked and fixed nodes are counted as paths
+    size_t maintain(size_t max_paths = 0);
+    unsigned long long countUnderfull(); //nodes except root with less than min_deg - 1 keys, reads whole tree
 
  private:
+    typedef typename Agg::type AggT;
+    typedef std::map<Key, std::pair<bool, Value> > Buffer; //false for deleted key
+    const static size_t agg_size = Agg::enabled ? sizeof(AggT) : 0;
+    const static size_t stat_size = Agg::counted ? sizeof(unsigned long long) + agg_size : 0; //stats aren't kept if not counted
+    static_assert(Agg::counted || !Agg::enabled, "Aggregate needs counted stats");
+
+    struct Val{ //value offset with aggregate of this value
+        unsigned long long place;
+        AggT agg;
+    };
+
+    struct Stat{ //number of keys and aggregate of subtree
+        unsigned long long cnt;
+        AggT agg;
+    };
+
     class Node{
      public:
-        Node(std::fstream &f, unsigned long long offset, Cacher &cache);
+        Node(WriteBack &f, unsigned long long offset, Cacher &cache);
         Node();
 
-        void writeNode(std::fstream &f, Logger &logger, Cacher &cache);
-        void delNode(std::fstream &f, Logger &logger, Cacher &cache, unsigned long long &nxt_space);
+        void writeNode(WriteBack &f, Logger &logger, Cacher &cache);
+        void delNode(Btree &t);
         void swap(Node &n);
-        void insertInLeaf(const Key &k, unsigned long long v);
+        void insertInLeaf(const Key &k, const Val &v);
         void eraseInLeaf(size_t pos);
         bool isLeaf();
-        void replaceKey(size_t pos, const Key &k, unsigned long long v);
-        void insert(const Key &k, unsigned long long v, unsigned long long son_offset);
-
-        const static size_t size = (2 * min_deg - 2) * sizeof(unsigned long long) + (2 * min_deg - 2) * sizeof(Key) + (2 * min_deg - 1) * sizeof(unsigned long long);
+        void replaceKey(size_t pos, const Key &k, const Val &v);
+        void insert(const Key &k, const Val &v, unsigned long long son_offset, const Stat &son);
+        void setAgg(size_t pos, const AggT &agg);
+        void setStat(size_t pos, const Stat &st);
+        Stat total();
+
+        const static size_t size = (2 * min_deg - 2) * (sizeof(unsigned long long) + sizeof(Key) + agg_size) + (2 * min_deg - 1) * (sizeof(unsigned long long) + stat_size);
+        const static size_t stats_at = size - (2 * min_deg - 1) * stat_size; //stats are last in file
         bool changed;
         unsigned long long offset;
         std::vector<Key> keys; //keys in order as in file
-        std::vector<unsigned long long> vals;
+        std::vector<Val> vals;
         std::vector<unsigned long long> refs; //references to next nodes (offsets)
+        std::vector<Stat> stats; //stats of subtrees for refs, not used if not counted
 
      private:
         char* getBinary();
         char old[size];
+        size_t stat_lo, stat_hi; //stats set since last write; if nothing else changed, only they are written
     };
 
-    void add(unsigned long long offset, const Key &k, const Value &v, Node *par);
-    void del(unsigned long long offset, const Key &k, Node *par, size_t pos);
+    template <typename F> void modify(const Key &k, F &fn);
+    template <typename F> void modifyBuffered(const Key &k, F &fn);
+    template <typename F> void add(unsigned long long offset, const Key &k, F &fn, Node *par, size_t from);
+    template <typename F> void update(Node &n, size_t pos, F &fn);
+    template <typename F> bool insertValue(Node &n, const Key &k, F &fn);
+    void split(Node &n, Node *par, size_t mid = min_deg);
+    template <typename F> bool append(const Key &k, F &fn);
+    template <typename F> bool addLast(size_t level, const Key &k, F &fn, Node *par, size_t from);
+    void loadRightPath();
+    void endStreak();
+    typename Buffer::iterator addRun(unsigned long long offset, typename Buffer::iterator it, typename Buffer::iterator end, const Key *hi, Node *par, size_t from);
+    void bufferPut(const Key &k, bool live, const Value &v);
+    void loadBuffer();
+    void writeBuffer();
+    void flushIfBuffered();
+    bool remove(const Key &k, Value *v);
+    bool del(unsigned long long offset, const Key &k, Node *par, size_t pos, Value *v = NULL);
+    bool lookup(const Key &k, Value *v); //in tree only
     bool find(unsigned long long offset, const Key &k, Value *v);
-    void get(unsigned long long offset, const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res);
-    std::pair<Key, unsigned long long> delNext(unsigned long long offset, Node *par, size_t pos, const Key &k);
+    template <typename F> bool scan(unsigned long long offset, const Key &l, const Key &r, bool reverse, F &f);
+    template <typename F> void scanMerged(const Key &l, const Key &r, bool reverse, F &f);
+    std::pair<Key, Val> delNext(unsigned long long offset, Node *par, size_t pos, const Key &k);
+    void fixOnDelete(Node &n, Node *par, size_t pos);
     void fix(Node &n, Node *par, size_t pos);
+    void restat(Node &n, Node *par);
+    unsigned long long trim(unsigned long long offset, const Key *l, const Key *r, std::vector<Key> &seps, Node *par, size_t from);
+    unsigned long long freeSubtree(unsigned long long offset); //returns number of keys in it
+    bool repair(unsigned long long offset, const Key &k, bool upper, Node *par);
+    size_t repairAll(unsigned long long offset, Node *par); //returns number of fixed nodes
+    unsigned long long countUnderfull(unsigned long long offset, bool is_root);
+    unsigned long long less(unsigned long long offset, const Key &k);
+    bool select(unsigned long long offset, unsigned long long i, Key *k, Value *v);
+    Stat subtree(Node &n, size_t i); //stat of i-th child
+    Stat range(unsigned long long offset, const Key *l, const Key *r, bool lx = false, bool rx = false);
+    Stat merged(const Key *l, const Key *r, bool rx = false);
+    template <typename F> void walk(unsigned long long offset, F &f);
+    template <typename F> void inorder(unsigned long long offset, F &f);
+
+    unsigned long long keyHash(const Key &k);
+    void filterAdd(const Key &k);
+    void filterDel();
+    bool saveFilter();
+    bool commitFiles();
+    void beforeBegin();
+    bool buffering(); //write buffer is on and not in transaction
+    void abort();
 
     Value getValue(unsigned long long offset);
     char* getValueBin(unsigned long long offset);
-    void writeValue(unsigned long long offset, const Value &val, bool new_val = false);
-    void delValue(unsigned long long offset);
+    void writeValue(unsigned long long offset, const Value &val, bool new_val = false, const char *old_bin = NULL);
+    void delValue(unsigned long long offset, Value *v = NULL);
 
-    unsigned long long getNextSpace(std::fstream &f, unsigned long long &next_pos, bool is_value);
-    void changeOffset(unsigned long long offset, std::fstream &f, unsigned long long &next_pos, bool is_value);
 
     Btree(const Btree &b);
     void operator= (const Btree &b);
 
-    unsigned long long nxt_space, nxt_space_vals;
-
-    const size_t root = sizeof(unsigned long long);
-    const  size_t size_value = std::max(sizeof(Value), sizeof(unsigned long long));
-
-    Logger logger;
-    std::fstream file, file_vals;
-    Cacher cache;
+    const static size_t size_value = sizeof(Value) > sizeof(unsigned long long) ? sizeof(Value) : sizeof(unsigned long long);
+
+    bool hash_on;
+    HashIndex<Key> *hash; //only for single tree
+
+    bool filter_on;
+    Bloom filter;
+    std::string filter_name;
+
+    bool buffer_on;
+    size_t buffer_limit;
+    Buffer buffer;
+    std::fstream wal;
+    std::string wal_name;
+
+    size_t underflow; //nodes with less keys are fixed on delete
+    bool underfull; //delete left some node underfull
+    std::set<Key> delayed; //deleted keys, upper_bound path to them has underfull nodes
+    bool swept; //maintain walked whole tree in this session
+
+    //inserts after append_streak increasing keys go straight down the rightmost path, whose nodes are kept
+    //decoded between inserts; its splits leave right nodes with few keys, they are fixed when the run ends
+    const static size_t append_streak = 16;
+    size_t streak;
+    Key last_key;
+    bool right_ok; //right_path and right_bound are valid
+    bool right_bounded; //false when rightmost leaf is root
+    bool light_spine; //nodes on the path to last_key may have less than min_deg - 1 keys
+    Key right_bound; //keys greater than it belong to rightmost leaf
+    std::vector<Node> right_path; //from root, changed in place and written by append
 };
 
-template <typename Key, typename Value, unsigned int t>
-Btree<Key, Value, t>::Btree():cache(Node::size){
-    file.open("btree.main", std::ios::in | std::ios::out | std::ios::binary);
-    file_vals.open("btree.vals", std::ios::in | std::ios::out | std::ios::binary);
-    logger.recoverTree(file, file_vals);
-    nxt_space = 0;
-    nxt_space_vals = 0;
-
-    if (getNextSpace(file, nxt_space, false) < Node::size + root){
-        file.seekp(0, std::ios_base::beg);
-        char buf[Node::size + root];
-        memset(buf, 0, Node::size + root);
-        file.write(buf, Node::size + root);
-    }else{
-        file.seekg(0, std::ios_base::beg);
-        file.read((char*)&nxt_space, sizeof(unsigned long long));
+template <typename Key, typename Value, unsigned int t, typename Agg>
+Btree<Key, Value, t, Agg>::Btree():TreeBase(new Database("btree.main", "btree.vals", "btree.log", "btree.hash"), "btree", Node::size, size_value),
+        hash_on(false), hash(NULL), filter_on(false), filter_name("btree.bloom"), buffer_on(false), buffer_limit(0),
+        wal_name("btree.wal"), underflow(t - 1), underfull(false), swept(false), streak(0), right_ok(false), light_spine(false){
+    if (HasHashKey<Key>::value && std::ifstream("btree.hash")){ //index is made by first enableHashIndex
+        hash = new HashIndex<Key>("btree.hash");
+        hash_on = hash -> load();
     }
+    loadBuffer();
+    flushIfBuffered(); //entries of last session
+}
 
-    if (getNextSpace(file_vals, nxt_space_vals, true) < sizeof(unsigned long long)){
-        file_vals.seekp(0, std::ios_base::beg);
-        char buf[sizeof(unsigned long long)];
-        memset(buf, 0, sizeof(unsigned long long));
-        file_vals.write(buf, sizeof(unsigned long long));
-    }else{
-        file_vals.seekg(0, std::ios_base::beg);
-        file_vals.read((char*)&nxt_space_vals, sizeof(unsigned long long));
+template <typename Key, typename Value, unsigned int t, typename Agg>
+Btree<Key, Value, t, Agg>::Btree(Database &db, const char *name):TreeBase(db, name, Node::size, size_value), hash_on(false), hash(NULL),
+        filter_on(false), filter_name(db.name + "." + name + ".bloom"), buffer_on(false), buffer_limit(0), wal_name(db.name + "." + name + ".wal"),
+        underflow(t - 1), underfull(false), swept(false), streak(0), right_ok(false), light_spine(false){
+    loadBuffer();
+    flushIfBuffered(); //entries of last session
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+Btree<Key, Value, t, Agg>::~Btree(){
+    if (!buffer.empty()){
+        try{
+            flushBuffer();
+        }catch (std::exception &e){} //still in wal
+    }
+    if (light_spine){
+        try{
+            logger.init();
+            endStreak();
+            if (writeBack())
+                logger.finish();
+        }catch (std::exception &e){} //tree is right, only less balanced
     }
+    if (filter_on)
+        saveFilter(); //if it fails filter is rebuilt on next enable
+    delete hash;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+bool Btree<Key, Value, t, Agg>::commitFiles(){
+    if (hash == NULL || (!hash_on && !hash -> pending()))
+        return true;
+    return hash -> commit();
+}
+
+//buffered entries go to tree before transaction, changes inside it skip buffer so abort drops them too
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::beforeBegin(){
+    flushIfBuffered();
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+bool Btree<Key, Value, t, Agg>::buffering(){
+    return buffer_on && !logger.inTransaction();
+}
 
-    if (!file.good() || !file_vals.good()){
-        file.close();
-        file_vals.close();
-        throw std::runtime_error("Error on opening file");
+//tree is as before begin
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::abort(){
+    TreeBase::abort();
+    right_ok = light_spine = underfull = swept = false;
+    streak = 0;
+    if (hash != NULL){
+        hash -> discard();
+        hash_on = hash -> load();
     }
 }
 
-template <typename Key, typename Value, unsigned int t>
-void Btree<Key, Value, t>::changeOffset(unsigned long long offset, std::fstream &f, unsigned long long &next_pos, bool is_value){
-    f.seekg(offset, std::ios_base::beg);
-    unsigned long long pos;
-    f.read((char*)&pos, sizeof(unsigned long long));
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::enableHashIndex(){
+    static_assert(HasHashKey<Key>::value, "Key has padding or several representations of one value, give hashKey for it");
+    if (hash_on)
+        return;
+    if (own == NULL)
+        throw std::runtime_error("Hash index is only for single tree");
+    if (hash == NULL)
+        hash = new HashIndex<Key>("btree.hash");
+    hash -> reset();
+    size_t num = 0;
+    bool ok = true;
+    auto add = [&](const Key &k, unsigned long long place){ //not logged, index is not valid until the end
+        hash -> put(k, place, NULL);
+        if (++num % 1024 == 0)
+            ok = hash -> commit() && ok;
+    };
+    inorder(root, add);
+    hash -> setValid(true);
+    ok = hash -> commit() && ok;
+    if (!ok || !file.good() || !file_vals.good())
+        throw std::runtime_error("Error with file while enableHashIndex");
+    hash_on = true;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::disableHashIndex(){
+    if (!hash_on)
+        return;
+    hash_on = false;
+    hash -> setValid(false);
+    if (!hash -> commit())
+        throw std::runtime_error("Error with file while disableHashIndex");
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+unsigned long long Btree<Key, Value, t, Agg>::keyHash(const Key &k){
+    return KeyHash<Key>::get(k);
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::enableFilter(size_t expected){
+    static_assert(HasHashKey<Key>::value, "Key has padding or several representations of one value, give hashKey for it");
+    filter_on = true;
+    if (!filter.load(filter_name.c_str(), generation))
+        rebuildFilter(expected);
+}
 
-    char buf[sizeof(unsigned long long)];
-    memcpy(buf, &offset, sizeof(unsigned long long));
-    logger.log(0, buf, sizeof(unsigned long long), is_value);
-    f.seekp(0, std::ios_base::beg);
-    f.write((char*)&pos, sizeof(unsigned long long));
-    next_pos = pos;
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::rebuildFilter(size_t expected){
+    std::vector<unsigned long long> hashes;
+    auto collect = [&](Node &n){
+        for (size_t i = 0; i < n.keys.size(); i++)
+            hashes.emplace_back(keyHash(n.keys[i]));
+    };
+    walk(root, collect);
+
+    filter.reset(std::max(std::max(expected, 2 * hashes.size()), (size_t)1024));
+    for (size_t i = 0; i < hashes.size(); i++)
+        filter.add(hashes[i]);
+    filter.elems = hashes.size();
+    if (!saveFilter())
+        throw std::runtime_error("Error in file for filter");
+}
+
+//filter saved inside transaction is marked dirty: generation may be rolled back and then reached again by other changes
+template <typename Key, typename Value, unsigned int t, typename Agg>
+bool Btree<Key, Value, t, Agg>::saveFilter(){
+    bool ok = filter.save(filter_name.c_str(), stamp());
+    if (ok && logger.inTransaction())
+        ok = filter.markDirty(filter_name.c_str());
+    return ok;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::filterAdd(const Key &k){
+    if (!filter.markDirty(filter_name.c_str()))
+        throw std::runtime_error("Error in file for filter");
+    filter.add(keyHash(k));
+    filter.elems++;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::filterDel(){
+    if (!filter.markDirty(filter_name.c_str()))
+        throw std::runtime_error("Error in file for filter");
+    filter.dels++;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+template <typename F>
+void Btree<Key, Value, t, Agg>::walk(unsigned long long offset, F &f){
+    Node n(file, offset, cache);
+    f(n);
+    for (size_t i = 0; i < n.refs.size(); i++)
+        walk(n.refs[i], f);
 }
 
-template <typename Key, typename Value, unsigned int t>
-unsigned long long Btree<Key, Value, t>::getNextSpace(std::fstream &f, unsigned long long &next_pos, bool is_value){
-    if (next_pos != 0){
-        unsigned long long offset = next_pos;
-        changeOffset(next_pos, f, next_pos, is_value);
-        return offset;
+template <typename Key, typename Value, unsigned int t, typename Agg>
+template <typename F>
+void Btree<Key, Value, t, Agg>::inorder(unsigned long long offset, F &f){
+    Node n(file, offset, cache);
+    for (size_t i = 0; i <= n.keys.size(); i++){
+        if (!n.isLeaf())
+            inorder(n.refs[i], f);
+        if (i < n.keys.size())
+            f(n.keys[i], n.vals[i].place);
     }
+}
 
-    f.seekg(0, std::ios_base::end);
-    return f.tellg();
+//streams keys and values to their places in parts, only upper levels of keys are kept until the end
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::freeze(const char *name){
+    flushIfBuffered();
+    logger.init();
+    unsigned long long n = range(root, NULL, NULL).cnt, i = 0;
+    FrozenLayout lay(n, sizeof(Key), sizeof(Value));
+    std::ofstream f(name, std::ios::out | std::ios::binary | std::ios::trunc);
+    std::vector<char> head(frozen_page, 0), keys, vals;
+    unsigned long long h[5] = {frozen_magic, n, sizeof(Key), sizeof(Value), lay.per_block};
+    memcpy(&head[0], h, sizeof(h));
+    f.write(&head[0], frozen_page);
+
+    std::vector<std::vector<Key> > upper(lay.cnt.size()); //levels above 0
+    unsigned long long keys_at = lay.start[0], vals_at = lay.vals;
+    auto out = [&](std::vector<char> &buf, unsigned long long &at){
+        f.seekp(at, std::ios_base::beg);
+        f.write(buf.data(), buf.size());
+        at += buf.size();
+        buf.clear();
+    };
+    auto collect = [&](const Key &k, unsigned long long place){
+        Value v = getValue(place);
+        for (size_t l = 1, j = i; l < lay.cnt.size() && j % lay.per_block == 0; l++){
+            j /= lay.per_block;
+            upper[l].emplace_back(k);
+        }
+        keys.insert(keys.end(), (const char*)&k, (const char*)&k + sizeof(Key));
+        vals.insert(vals.end(), (const char*)&v, (const char*)&v + sizeof(Value));
+        if (++i % lay.per_block == 0){
+            keys.resize(keys.size() + lay.stride - lay.per_block * sizeof(Key), 0);
+            if (keys.size() >= (1 << 20)){
+                out(keys, keys_at);
+                out(vals, vals_at);
+            }
+        }
+    };
+    inorder(root, collect);
+    if (!file.good() || !file_vals.good() || i != n)
+        throw std::runtime_error("Error with file while freeze");
+    logger.finish();
+    out(keys, keys_at);
+    out(vals, vals_at);
+
+    for (size_t l = 1; l < lay.cnt.size(); l++){
+        for (unsigned long long j = 0; j < upper[l].size(); j++){
+            if (j % lay.per_block == 0 && j != 0)
+                keys.resize((j / lay.per_block) * lay.stride, 0);
+            keys.insert(keys.end(), (const char*)&upper[l][j], (const char*)&upper[l][j] + sizeof(Key));
+        }
+        keys_at = lay.start[l];
+        out(keys, keys_at);
+    }
+    f.flush();
+    if (!f.good())
+        throw std::runtime_error("Error with file while freeze");
 }
 
-template <typename Key, typename Value, unsigned int t>
-bool Btree<Key, Value, t>::findElem(const Key &k, Value *v){
+template <typename Key, typename Value, unsigned int t, typename Agg>
+bool Btree<Key, Value, t, Agg>::findElem(const Key &k, Value *v){
+    if (!buffer.empty()){
+        typename Buffer::iterator it = buffer.find(k);
+        if (it != buffer.end()){
+            if (it -> second.first)
+                *v = it -> second.second;
+            return it -> second.first;
+        }
+    }
+    return lookup(k, v);
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+bool Btree<Key, Value, t, Agg>::lookup(const Key &k, Value *v){
+    if (filter_on && !filter.mayContain(keyHash(k)))
+        return false;
     logger.init();
-    bool res = find(root, k, v);
-    file.flush();
-    file_vals.flush();
-    if (!file.good() || !file_vals.good())
+    bool res;
+    unsigned long long place;
+    if (hash_on){
+        res = hash -> find(k, &place);
+        if (res)
+            *v = getValue(place);
+    }else{
+        res = find(root, k, v);
+    }
+    if (!writeBack())
         throw std::runtime_error("Error with file while findElem");
     logger.finish();
     return res;
 }
 
-template <typename Key, typename Value, unsigned int t>
-Value Btree<Key, Value, t>::getValue(unsigned long long offset){
+template <typename Key, typename Value, unsigned int t, typename Agg>
+Value Btree<Key, Value, t, Agg>::getValue(unsigned long long offset){
     Value v;
-    file_vals.seekg(offset, std::ios_base::beg);
-    file_vals.read((char*)&v, sizeof(Value));
+    char *res = vals_cache.get(offset);
+    if (res != NULL){
+        memcpy((char*)&v, res, sizeof(Value));
+        return v;
+    }
+    char buf[size_value];
+    file_vals.read(offset, buf, size_value);
+    vals_cache.update(offset, buf, size_value);
+    memcpy((char*)&v, buf, sizeof(Value));
     return v;
 }
 
-template <typename Key, typename Value, unsigned int t>
-char* Btree<Key, Value, t>::getValueBin(unsigned long long offset){
+template <typename Key, typename Value, unsigned int t, typename Agg>
+char* Btree<Key, Value, t, Agg>::getValueBin(unsigned long long offset){
     char *buf = new char[size_value];
-    file_vals.seekg(offset, std::ios_base::beg);
-    file_vals.read(buf, size_value);
+    char *res = vals_cache.get(offset);
+    if (res != NULL){
+        memcpy(buf, res, size_value);
+        return buf;
+    }
+    file_vals.read(offset, buf, size_value);
+    vals_cache.update(offset, buf, size_value);
     return buf;
 }
 
-template <typename Key, typename Value, unsigned int t>
-bool Btree<Key, Value, t>::find(unsigned long long offset, const Key &k, Value *v){
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::setValueCacheSize(size_t bytes){
+    vals_cache.setMaxSize(bytes);
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::valueCacheStats(unsigned long long *hits, unsigned long long *misses){
+    *hits = vals_cache.hits;
+    *misses = vals_cache.misses;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+bool Btree<Key, Value, t, Agg>::find(unsigned long long offset, const Key &k, Value *v){
     Node n(file, offset, cache);
     typename std::vector<Key>::iterator it = lower_bound(n.keys.begin(), n.keys.end(), k);
     size_t pos = it - n.keys.begin();
     if (it != n.keys.end() && *it == k){
-        *v = getValue(n.vals[pos]);
+        *v = getValue(n.vals[pos].place);
         return true;
     }else
     if (!n.isLeaf()){
@@ -184,94 +536,646 @@ bool Btree<Key, Value, t>::find(unsigned long long offset, const Key &k, Value *
     return false;
 }
 
-template <typename Key, typename Value, unsigned int t>
-void Btree<Key, Value, t>::getElems(const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res){
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::getElems(const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res, size_t limit, bool reverse){
+    if (r < l)
+        return;
+    size_t start = res.size();
+    auto add = [&](const Key &k, unsigned long long place, const Value *v){
+        res.emplace_back(k, v != NULL ? *v : getValue(place));
+        return limit == 0 || res.size() - start < limit;
+    };
     logger.init();
-    get(root, l, r, res);
-    file.flush();
-    file_vals.flush();
-    if (!file.good() || !file_vals.good())
+    scanMerged(l, r, reverse, add);
+    if (!writeBack())
         throw std::runtime_error("Error with file while getElems");
     logger.finish();
 }
 
-template <typename Key, typename Value, unsigned int t>
-void Btree<Key, Value, t>::get(unsigned long long offset, const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res){
+template <typename Key, typename Value, unsigned int t, typename Agg>
+void Btree<Key, Value, t, Agg>::getKeys(const Key &l, const Key &r, std::vector<Key> &res, size_t limit, bool reverse){
+    if (r < l)
+        return;
+    size_t start = res.size();
+    auto add = [&](const Key &k, unsigned long long, const Value *){
+        res.emplace_back(k);
+        return limit == 0 || res.size() - start < limit;
+    };
+    logger.init();
+    scanMerged(l, r, reverse, add);
+    if (!writeBack())
+        throw std::runtime_error("Error with file while getKeys");
+    logger.finish();
+}
+
+//calls f(key, value offset) for keys of [l, r] in order, returns false when f asked to stop
+template <typename Key, typename Value, unsigned int t, typename Agg>
+template <typename F>
+bool Btree<Key, Value, t, Agg>::scan(unsigned long long offset, const Key &l, const Key &r, bool reverse, F &f){
     Node n(file, offset, cache);
-    typename std::vector<Key>::iterator lit = lower_bound(n.keys.begin(), n.keys.end(), l);
-    typename std::vector<Key>::iterator rit = upper_bound(n.keys.begin(), n.keys.end(), r);
-    size_t lpos = lit - n.keys.begin(), rpos = rit - n.keys.begin();
-    if (!n.isLeaf())
-    for (size_t i = lpos; i <= rpos; i++)
-        get(n.refs[i], l, r, res);
-    for (size_t i = lpos; i < rpos; i++)
-        res.emplace_back(n.keys[i], getValue(n.vals[i]));
-}
-
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::addElem(const Key &k, const Value &v){
+    size_t lpos = lower_bound(n.keys.begin(), n.keys.end(), l) - n.keys.begin();
+    size_t rpos = upper_bound(n.keys.begin(), n.keys.end(), r) - n.keys.begin();
+    for (size_t j = 0; j <= rpos - lpos; j++){
+        size_t i = (reverse ? rpos - j : lpos + j);
+        if (reverse && i < rpos && !f(n.keys[i], n.vals[i].place))
+            return false;
+        if (!n.isLeaf() && !scan(n.refs[i], l, r, reverse, f))
+            return false;
+        if (!reverse && i < rpos && !f(n.keys[i], n.vals[i].place))
+            return false;
+    }
+    return true;
+}
+
+//calls f(key, value offset, buffered value) for live keys of [l, r] of tree and buffer in order, value is
+//from buffer if it isn't NULL; buffered entries are merged while the tree is scanned, so both stop with f
+template <typename Key, typename Value, unsigned int t, typename Agg>
+template <typename F>
+void Btree<Key, Value, t, Agg>::scanMerged(const Key &l, const Key &r, bool reverse, F &f){
+    typename Buffer::iterator lo = buffer.lower_bound(l), hi = buffer.upper_bound(r);
+    typename Buffer::iterator it = (reverse ? hi : lo), stop = (reverse ? lo : hi); //next entry is before it if reverse
+    auto next = [&](){
+        return (reverse ? std::prev(it) : it);
+    };
+    auto before = [&](const Key *k){ //passes buffered entries which go before k (all if NULL), false if f stopped
+        while (it != stop){
+            typename Buffer::iterator e = next();
+            if (k != NULL && !(reverse ? *k < e -> first : e -> first < *k))
+                return true;
+            it = (reverse ? e : std::next(e));
+            if (e -> second.first && !f(e -> first, 0, &e -> second.second))
+                return false;
+        }
+        return true;
+    };
+    auto tree = [&](const Key &k, unsigned long long place){
+        if (!before(&k))
+            return false;
+        if (it != stop && !(reverse ? next() -> first < k : k < next() -> first)){ //buffered change replaces it
+            typename Buffer::iterator e = next();
+            it = (reverse ? e : std::next(e));
+            return !e -> second.first || f(k, 0, &e -> second.second);
+        }
+        return f(k, place, (const Value*)NULL);
+    };
+    if (scan(root, l, r, reverse, tree))
+        before(NULL);
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+unsigned long long Btree<Key, Value, t, Agg>::size(){
+    if (buffer.empty() && Agg::counted){
+        Node n(file, root, cache);
+        return n.total().cnt;
+    }
+    logger.init();
+    unsigned long long res = merged(NULL, NULL).cnt;
+    if (!file.good())
+        throw std::runtime_error("Error with file while size");
+    logger.finish();
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+unsigned long long Btree<Key, Value, t, Agg>::count(const Key &l, const Key &r){
+    if (r < l)
+        return 0;
+    logger.init();
+    unsigned long long res = merged(&l, &r).cnt;
+    if (!file.good())
+        throw std::runtime_error("Error with file while count");
+    logger.finish();
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+typename Agg::type Btree<Key, Value, t, Agg>::aggregate(const Key &l, const Key &r){
+    if (r < l)
+        return Agg::identity();
+    logger.init();
+    AggT res = merged(&l, &r).agg;
+    if (!file.good())
+        throw std::runtime_error("Error with file while aggregate");
+    logger.finish();
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+typename Btree<Key, Value, t, Agg>::Stat Btree<Key, Value, t, Agg>::range(unsigned long long offset, const Key *l, const Key *r, bool lx, bool rx){
+    //NULL bound is open, lx and rx make bounds exclusive
+    Node n(file, offset, cache);
+    size_t lpos = 0, rpos = n.keys.size();
+    if (l != NULL)
+        lpos = (lx ? upper_bound(n.keys.begin(), n.keys.end(), *l) : lower_bound(n.keys.begin(), n.keys.end(), *l)) - n.keys.begin();
+    if (r != NULL)
+        rpos = (rx ? lower_bound(n.keys.begin(), n.keys.end(), *r) : upper_bound(n.keys.begin(), n.keys.end(), *r)) - n.keys.begin();
+
+    Stat res = {rpos - lpos, Agg::identity()};
+    for (size_t i = lpos; i <= rpos; i++){
+        if (!n.isLeaf()){
+            const Key *cl = (i == lpos ? l : NULL), *cr = (i == rpos ? r : NULL);
+            Stat st = (cl == NULL && cr == NULL ? subtree(n, i) : range(n.refs[i], cl, cr, lx, rx)); //only two paths are visited
+            res.cnt += st.cnt;
+            res.agg = Agg::merge(res.agg, st.agg);
+        }
+        if (i < rpos)
+            res.agg = Agg::merge(res.agg, n.vals[i].agg);
+    }
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+typename Btree<Key, Value, t, Agg>::Stat Btree<Key, Value, t, Agg>::subtree(Node &n, size_t i){
+    if (Agg::counted)
+        return n.stats[i];
+    return range(n.refs[i], NULL, NULL);
+}
+
+//stat of [l, r] (r excluded if rx) as if buffer was flushed: tree parts between buffered keys and live buffered values
+template <typename Key, typename Value, unsigned int t, typename Agg>
+typename Btree<Key, Value, t, Agg>::Stat Btree<Key, Value, t, Agg>::merged(const Key *l, const Key *r, bool rx){
+    typename Buffer::iterator it = (l == NULL ? buffer.begin() : buffer.lower_bound(*l));
+    typename Buffer::iterator end = (r == NULL ? buffer.end() : rx ? buffer.lower_bound(*r) : buffer.upper_bound(*r));
+    Stat res = {0, Agg::identity()};
+    const Key *from = l;
+    for (; it != end; it++){
+        Stat st = range(root, from, &it -> first, from != l, true);
+        res.cnt += st.cnt;
+        res.agg = Agg::merge(res.agg, st.agg);
+        if (it -> second.first){
+            res.cnt++;
+            res.agg = Agg::merge(res.agg, Agg::fromValue(it -> second.second));
+        }
+        from = &it -> first;
+    }
+    Stat st = range(root, from, r, from != l, rx);
+    res.cnt += st.cnt;
+    res.agg = Agg::merge(res.agg, st.agg);
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+unsigned long long Btree<Key, Value, t, Agg>::rank(const Key &k){
+    logger.init();
+    unsigned long long res = (buffer.empty() ? less(root, k) : merged(NULL, &k, true).cnt);
+    if (!file.good())
+        throw std::runtime_error("Error with file while rank");
+    logger.finish();
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+unsigned long long Btree<Key, Value, t, Agg>::less(unsigned long long offset, const Key &k){
+    Node n(file, offset, cache);
+    size_t pos = lower_bound(n.keys.begin(), n.keys.end(), k) - n.keys.begin();
+    unsigned long long res = pos;
+    if (n.isLeaf())
+        return res;
+    for (size_t i = 0; i < pos; i++)
+        res += subtree(n, i).cnt;
+    return res + less(n.refs[pos], k);
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+bool Btree<Key, Value, t, Agg>::select(unsigned long long i, Key *k, Value *v){
     logger.init();
-    add(root, k, v, NULL); //for root parent = NULL
-    file.flush();
-    file_vals.flush();
+    //tree parts between buffered keys are skipped by their counts, tree index of wanted key is found in them
+    unsigned long long skipped = 0; //tree keys before current part
+    bool in_buffer = false;
+    const Key *from = NULL;
+    for (typename Buffer::iterator it = buffer.begin(); it != buffer.end(); it++){
+        unsigned long long cnt = range(root, from, &it -> first, from != NULL, true).cnt;
+        if (i < cnt)
+            break;
+        i -= cnt;
+        skipped += cnt + range(root, &it -> first, &it -> first).cnt;
+        if (it -> second.first && i-- == 0){
+            *k = it -> first;
+            *v = it -> second.second;
+            in_buffer = true;
+            break;
+        }
+        from = &it -> first;
+    }
+    bool res = (in_buffer || select(root, skipped + i, k, v));
     if (!file.good() || !file_vals.good())
+        throw std::runtime_error("Error with file while select");
+    logger.finish();
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int t, typename Agg>
+bool Btree<Key, Value, t, Agg>::select(unsigned long long offset, unsigned long long i, Key *k, Value *v){
+    Node n(file, offset, cache);
+    for (size_t j = 0; j <= n.keys.size(); j++){
+        if (!n.isLeaf()){
+            unsigned long long cnt = subtree(n, j).cnt;
+            if (i < cnt)
+                return select(n.refs[j], i, k, v);
+            i -= cnt;
+        }
+        if (j == n.keys.size())
+            break;
+        if (i == 0){
+            *k = n.keys[j];
+            *v = getValue(n.vals[j].place);
+            return true;
+        }
+        i--;
+    }
+    return false;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::enableWriteBuffer(size_t max_entries){
+    buffer_on = true;
+    buffer_limit = std::max(max_entries, (size_t)1);
+    writeBuffer();
+    if (buffer.size() >= buffer_limit)
+        flushBuffer();
+}
+
+//entries left in wal, torn last record is dropped
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::loadBuffer(){
+    std::ifstream in(wal_name.c_str(), std::ios::in | std::ios::binary);
+    char live;
+    Key k;
+    Value v;
+    while (in.read(&live, 1) && in.read((char*)&k, sizeof(Key)) && in.read((char*)&v, sizeof(Value)))
+        buffer[k] = std::make_pair(live != 0, v);
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::writeBuffer(){
+    if (wal.is_open())
+        wal.close();
+    wal.open(wal_name.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    for (typename Buffer::iterator it = buffer.begin(); it != buffer.end(); it++){
+        char live = it -> second.first;
+        wal.write(&live, 1);
+        wal.write((char*)&it -> first, sizeof(Key));
+        wal.write((char*)&it -> second.second, sizeof(Value));
+    }
+    wal.flush();
+    if (!wal.good())
+        throw std::runtime_error("Error in file for write buffer");
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::bufferPut(const Key &k, bool live, const Value &v){
+    char c = live;
+    wal.seekp(0, std::ios_base::end);
+    wal.write(&c, 1);
+    wal.write((char*)&k, sizeof(Key));
+    wal.write((char*)&v, sizeof(Value));
+    wal.flush();
+    if (!wal.good())
+        throw std::runtime_error("Error in file for write buffer");
+    buffer[k] = std::make_pair(live, v);
+    if (buffer.size() >= buffer_limit)
+        flushBuffer();
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::flushIfBuffered(){
+    if (!buffer.empty())
+        flushBuffer();
+}
+
+//merges buffer in key order as one logged operation, runs of new keys for one leaf share the descent
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::flushBuffer(){
+    if (buffer.empty())
+        return;
+    logger.init();
+    endStreak();
+    typename Buffer::iterator it = buffer.begin();
+    while (it != buffer.end()){
+        if (it -> second.first){
+            it = addRun(root, it, buffer.end(), NULL, NULL, 0);
+        }else{
+            if (del(root, it -> first, NULL, 0) && filter_on)
+                filterDel();
+            it++;
+        }
+    }
+    if (!writeBack())
+        throw std::runtime_error("Error with file while flushBuffer");
+    logger.finish();
+    buffer.clear();
+    writeBuffer(); //after finish: if we fall before, replaying buffer again is harmless
+
+    if (filter_on && filter.elems > filter.capacity)
+        rebuildFilter(2 * filter.elems);
+    else if (filter_on && 2 * filter.dels > filter.elems)
+        rebuildFilter();
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::addElem(const Key &k, const Value &v){
+    if (buffering()){
+        bufferPut(k, true, v);
+        return;
+    }
+    auto fn = [&](Value &cur, bool){
+        cur = v;
+        return true;
+    };
+    modify(k, fn);
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+bool Btree<Key, Value, min_deg, Agg>::updateElem(const Key &k, F fn){
+    bool res = false;
+    auto upd = [&](Value &cur, bool exists){
+        if (!exists)
+            return false;
+        fn(cur);
+        res = true;
+        return true;
+    };
+    modify(k, upd);
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+void Btree<Key, Value, min_deg, Agg>::upsert(const Key &k, F fn){
+    auto upd = [&](Value &cur, bool exists){
+        fn(cur, exists);
+        return true;
+    };
+    modify(k, upd);
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+bool Btree<Key, Value, min_deg, Agg>::insertIfAbsent(const Key &k, const Value &v, Value *existing){
+    bool res = false;
+    auto ins = [&](Value &cur, bool exists){
+        if (exists){
+            *existing = cur;
+            return false;
+        }
+        cur = v;
+        res = true;
+        return true;
+    };
+    modify(k, ins);
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+void Btree<Key, Value, min_deg, Agg>::modify(const Key &k, F &fn){
+    if (buffering()){
+        modifyBuffered(k, fn);
+        return;
+    }
+    flushIfBuffered();
+    logger.init();
+    if (streak != 0 && !(last_key < k))
+        endStreak();
+    streak++;
+    last_key = k;
+    if (streak < append_streak || !append(k, fn))
+        add(root, k, fn, NULL, 0); //for root parent = NULL
+    if (!writeBack())
         throw std::runtime_error("Error with file while addElem");
     logger.finish();
+    if (filter_on && filter.elems > filter.capacity) //too many keys for the wanted false positive rate
+        rebuildFilter(2 * filter.elems);
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::add(unsigned long long offset, const Key &k, const Value &v, Node *par){
+//current value is taken from buffer or read from tree, result goes to buffer
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+void Btree<Key, Value, min_deg, Agg>::modifyBuffered(const Key &k, F &fn){
+    Value cur = Value();
+    bool exists;
+    typename Buffer::iterator it = buffer.find(k);
+    if (it != buffer.end()){
+        exists = it -> second.first;
+        if (exists)
+            cur = it -> second.second;
+    }else{
+        exists = lookup(k, &cur);
+    }
+    if (fn(cur, exists))
+        bufferPut(k, true, cur);
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+void Btree<Key, Value, min_deg, Agg>::add(unsigned long long offset, const Key &k, F &fn, Node *par, size_t from){
+    right_ok = false; //nodes of right_path may be changed
     Node n(file, offset, cache);
     typename std::vector<Key>::iterator it = lower_bound(n.keys.begin(), n.keys.end(), k);
     size_t pos = it - n.keys.begin();
     if (it != n.keys.end() && *it == k){
-        writeValue(n.vals[pos], v);
+        update(n, pos, fn);
     }else{
         if (n.isLeaf()){ //leaf
-            bool new_val = (nxt_space_vals == 0);
-            unsigned long long place = getNextSpace(file_vals, nxt_space_vals, true);
-            writeValue(place, v, new_val);
-            n.insertInLeaf(k, place);
+            if (!insertValue(n, k, fn))
+                return;
         }else{ //not leaf
-            add(n.refs[pos], k, v, &n);
+            add(n.refs[pos], k, fn, &n, pos);
         }
     }
 
+    if (n.keys.size() == 2 * min_deg - 1)
+        split(n, par);
+    if (par != NULL)
+        par -> setStat(from, n.total());
+    n.writeNode(file, logger, cache);
+}
+
+//insert of key above all separators on the rightmost path, false if k is not such key
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+bool Btree<Key, Value, min_deg, Agg>::append(const Key &k, F &fn){
+    if (!right_ok)
+        loadRightPath();
+    if (right_bounded && !(right_bound < k))
+        return false;
+    try{
+        addLast(0, k, fn, NULL, 0);
+    }catch (...){ //kept nodes may be half changed
+        right_ok = false;
+        throw;
+    }
+    return true;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+bool Btree<Key, Value, min_deg, Agg>::addLast(size_t level, const Key &k, F &fn, Node *par, size_t from){
+    Node &n = right_path[level];
+    if (n.isLeaf()){
+        typename std::vector<Key>::iterator it = lower_bound(n.keys.begin(), n.keys.end(), k);
+        if (it != n.keys.end() && *it == k)
+            update(n, it - n.keys.begin(), fn);
+        else if (!insertValue(n, k, fn))
+            return false;
+    }else if (!addLast(level + 1, k, fn, &n, n.refs.size() - 1)){
+        return false;
+    }
+
     if (n.keys.size() == 2 * min_deg - 1){
-        Node new_node;
-        size_t mid = min_deg;
-        n.changed = new_node.changed = true;
-        new_node.offset = getNextSpace(file, nxt_space, false);
-        new_node.vals.insert(new_node.vals.begin(), n.vals.begin() + mid, n.vals.end());
-        new_node.keys.insert(new_node.keys.begin(), n.keys.begin() + mid, n.keys.end());
-        if (!n.isLeaf())
-            new_node.refs.insert(new_node.refs.begin(), n.refs.begin() + mid, n.refs.end());
-
-        new_node.writeNode(file, logger, cache);
-
-        if (par == NULL){
-            Node new_root;
-            new_root.offset = getNextSpace(file, nxt_space, false);
-            new_root.changed = true;
-            new_root.swap(n);
-            new_root.refs.emplace_back(n.offset);
-            new_root.insert(n.keys[mid - 1], n.vals[mid - 1], new_node.offset);
-            new_root.writeNode(file, logger, cache);
-        }else{
-            par -> insert(n.keys[mid - 1], n.vals[mid - 1], new_node.offset);
+        split(n, par, 2 * min_deg - 2); //next keys go to the right, so left node is left almost full
+        light_spine = true;
+    }
+    if (par != NULL)
+        par -> setStat(from, n.total());
+    n.writeNode(file, logger, cache);
+    return true;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::loadRightPath(){
+    right_path.clear();
+    right_bounded = false;
+    unsigned long long offset = root;
+    while (true){
+        right_path.emplace_back(file, offset, cache);
+        Node &n = right_path.back();
+        if (n.isLeaf())
+            break;
+        if (!n.keys.empty()){
+            right_bounded = true;
+            right_bound = n.keys.back();
         }
+        offset = n.refs.back();
+    }
+    right_ok = true;
+}
 
-        n.vals.resize(mid - 1);
-        n.keys.resize(mid - 1);
-        if (!n.isLeaf())
-            n.refs.resize(mid);
+//called inside operation which breaks run of increasing inserts
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::endStreak(){
+    streak = 0;
+    if (light_spine)
+        while (repair(root, last_key, true, NULL)); //merges may leave parents underfull
+    light_spine = false;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+void Btree<Key, Value, min_deg, Agg>::update(Node &n, size_t pos, F &fn){
+    char *old = getValueBin(n.vals[pos].place); //read once for both callback and undo log
+    Value cur;
+    memcpy((char*)&cur, old, sizeof(Value));
+    if (fn(cur, true)){
+        writeValue(n.vals[pos].place, cur, false, old);
+        n.setAgg(pos, Agg::fromValue(cur));
+    }
+    delete[] old;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+template <typename F>
+bool Btree<Key, Value, min_deg, Agg>::insertValue(Node &n, const Key &k, F &fn){
+    Value cur = Value();
+    if (!fn(cur, false))
+        return false;
+    bool new_val = (nxt_space_vals == 0);
+    unsigned long long place = allocate(true);
+    writeValue(place, cur, new_val);
+    n.insertInLeaf(k, Val{place, Agg::fromValue(cur)});
+    if (hash_on)
+        hash -> put(k, place, &logger);
+    if (filter_on)
+        filterAdd(k);
+    return true;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::split(Node &n, Node *par, size_t mid){ //keys before mid - 1 stay in n
+    Node new_node;
+    right_ok = false;
+    n.changed = new_node.changed = true;
+    new_node.offset = allocate(false);
+    new_node.vals.insert(new_node.vals.begin(), n.vals.begin() + mid, n.vals.end());
+    new_node.keys.insert(new_node.keys.begin(), n.keys.begin() + mid, n.keys.end());
+    if (!n.isLeaf()){
+        new_node.refs.insert(new_node.refs.begin(), n.refs.begin() + mid, n.refs.end());
+        new_node.stats.insert(new_node.stats.begin(), n.stats.begin() + mid, n.stats.end());
+    }
+
+    new_node.writeNode(file, logger, cache);
+
+    Key mid_key = n.keys[mid - 1];
+    Val mid_val = n.vals[mid - 1];
+    n.vals.resize(mid - 1);
+    n.keys.resize(mid - 1);
+    if (!n.isLeaf()){
+        n.refs.resize(mid);
+        n.stats.resize(mid);
     }
+
+    if (par == NULL){
+        Node new_root;
+        new_root.offset = allocate(false);
+        new_root.changed = true;
+        new_root.swap(n);
+        new_root.refs.emplace_back(n.offset);
+        new_root.stats.emplace_back(n.total());
+        new_root.insert(mid_key, mid_val, new_node.offset, new_node.total());
+        new_root.writeNode(file, logger, cache);
+    }else{
+        par -> insert(mid_key, mid_val, new_node.offset, new_node.total());
+    }
+}
+
+//puts a run of sorted buffered pairs with one descent: all of them that fall into the same leaf are inserted there
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+typename Btree<Key, Value, min_deg, Agg>::Buffer::iterator Btree<Key, Value, min_deg, Agg>::addRun(unsigned long long offset, typename Buffer::iterator it, typename Buffer::iterator end, const Key *hi, Node *par, size_t from){
+    right_ok = false; //nodes of right_path may be changed
+    Node n(file, offset, cache);
+    size_t pos = lower_bound(n.keys.begin(), n.keys.end(), it -> first) - n.keys.begin();
+    if (pos != n.keys.size() && n.keys[pos] == it -> first){
+        auto fn = [&](Value &cur, bool){
+            cur = it -> second.second;
+            return true;
+        };
+        update(n, pos, fn);
+        it++;
+    }else if (!n.isLeaf()){
+        if (pos < n.keys.size()){
+            Key bound = n.keys[pos];
+            it = addRun(n.refs[pos], it, end, &bound, &n, pos);
+        }else{
+            it = addRun(n.refs[pos], it, end, hi, &n, pos);
+        }
+    }else{
+        while (it != end && it -> second.first && (hi == NULL || it -> first < *hi) && n.keys.size() < 2 * min_deg - 1){
+            auto fn = [&](Value &cur, bool){
+                cur = it -> second.second;
+                return true;
+            };
+            pos = lower_bound(n.keys.begin(), n.keys.end(), it -> first) - n.keys.begin();
+            if (pos != n.keys.size() && n.keys[pos] == it -> first)
+                update(n, pos, fn);
+            else
+                insertValue(n, it -> first, fn);
+            it++;
+        }
+    }
+
+    if (n.keys.size() == 2 * min_deg - 1)
+        split(n, par);
+    if (par != NULL)
+        par -> setStat(from, n.total());
     n.writeNode(file, logger, cache);
+    return it;
 }
 
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::fix(Node &n, Node *par, size_t pos){
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::fix(Node &n, Node *par, size_t pos){ //stats of n in par are set by caller, see restat
+    right_ok = false;
     if (par == NULL){ //root
         if (n.keys.size() == 0 && n.refs.size() != 0){
             Node new_root(file, n.refs[0], cache);
@@ -279,7 +1183,8 @@ void Btree<Key, Value, min_deg>::fix(Node &n, Node *par, size_t pos){
             std::swap(n.keys, new_root.keys);
             std::swap(n.vals, new_root.vals);
             std::swap(n.refs, new_root.refs);
-            new_root.delNode(file, logger, cache, nxt_space);
+            std::swap(n.stats, new_root.stats);
+            new_root.delNode(*this);
         } // else all is fine
 
         return;
@@ -292,15 +1197,20 @@ void Btree<Key, Value, min_deg>::fix(Node &n, Node *par, size_t pos){
             n.changed = left.changed = par -> changed = true;
             n.keys.insert(n.keys.begin(), par -> keys[pos - 1]);
             n.vals.insert(n.vals.begin(), par -> vals[pos - 1]);
-            if (!n.isLeaf())
+            if (!n.isLeaf()){
                 n.refs.insert(n.refs.begin(), left.refs.back());
+                n.stats.insert(n.stats.begin(), left.stats.back());
+            }
             par -> keys[pos - 1] = left.keys.back();
             par -> vals[pos - 1] = left.vals.back();
             left.keys.pop_back();
             left.vals.pop_back();
-            if (!n.isLeaf())
+            if (!n.isLeaf()){
                 left.refs.pop_back();
+                left.stats.pop_back();
+            }
 
+            par -> setStat(pos - 1, left.total());
             left.writeNode(file, logger, cache);
         }else{
             n.changed = left.changed = par -> changed = true;
@@ -309,11 +1219,13 @@ void Btree<Key, Value, min_deg>::fix(Node &n, Node *par, size_t pos){
             n.keys.insert(n.keys.begin(), left.keys.begin(), left.keys.end());
             n.vals.insert(n.vals.begin(), left.vals.begin(), left.vals.end());
             n.refs.insert(n.refs.begin(), left.refs.begin(), left.refs.end());
+            n.stats.insert(n.stats.begin(), left.stats.begin(), left.stats.end());
             par -> keys.erase(par -> keys.begin() + pos - 1);
             par -> vals.erase(par -> vals.begin() + pos - 1);
             par -> refs.erase(par -> refs.begin() + pos - 1);
+            par -> stats.erase(par -> stats.begin() + pos - 1);
 
-            left.delNode(file, logger, cache, nxt_space);
+            left.delNode(*this);
         }
         return;
     }
@@ -325,15 +1237,20 @@ void Btree<Key, Value, min_deg>::fix(Node &n, Node *par, size_t pos){
             n.changed = right.changed = par -> changed = true;
             n.keys.insert(n.keys.end(), par -> keys[pos]);
             n.vals.insert(n.vals.end(), par -> vals[pos]);
-            if (!n.isLeaf())
+            if (!n.isLeaf()){
                 n.refs.insert(n.refs.end(), right.refs.front());
+                n.stats.insert(n.stats.end(), right.stats.front());
+            }
             par -> keys[pos] = right.keys.front();
             par -> vals[pos] = right.vals.front();
             right.keys.erase(right.keys.begin());
             right.vals.erase(right.vals.begin());
-            if (!n.isLeaf())
+            if (!n.isLeaf()){
                 right.refs.erase(right.refs.begin());
+                right.stats.erase(right.stats.begin());
+            }
 
+            par -> setStat(pos + 1, right.total());
             right.writeNode(file, logger, cache);
         }else{
 
@@ -343,58 +1260,306 @@ void Btree<Key, Value, min_deg>::fix(Node &n, Node *par, size_t pos){
             n.keys.insert(n.keys.end(), right.keys.begin(), right.keys.end());
             n.vals.insert(n.vals.end(), right.vals.begin(), right.vals.end());
             n.refs.insert(n.refs.end(), right.refs.begin(), right.refs.end());
+            n.stats.insert(n.stats.end(), right.stats.begin(), right.stats.end());
             par -> keys.erase(par -> keys.begin() + pos);
             par -> vals.erase(par -> vals.begin() + pos);
             par -> refs.erase(par -> refs.begin() + pos + 1);
+            par -> stats.erase(par -> stats.begin() + pos + 1);
 
-            right.delNode(file, logger, cache, nxt_space);
+            right.delNode(*this);
         }
         return;
     }
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::delElem(const Key &k){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::fixOnDelete(Node &n, Node *par, size_t pos){
+    if (n.keys.size() < underflow)
+        fix(n, par, pos);
+    if (par != NULL && n.keys.size() < min_deg - 1)
+        underfull = true;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::enableLazyDelete(size_t min_keys){
+    underflow = std::min<size_t>(std::max<size_t>(min_keys, 1), min_deg - 1);
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::disableLazyDelete(){
+    underflow = min_deg - 1; //nodes left underfull before are fixed by maintain
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+size_t Btree<Key, Value, min_deg, Agg>::maintain(size_t max_paths){
+    size_t res = 0;
+    while (!delayed.empty() && (max_paths == 0 || res < max_paths)){
+        Key k = *delayed.begin();
+        logger.init();
+        while (repair(root, k, true, NULL)); //merges may leave parents underfull
+        if (!writeBack())
+            throw std::runtime_error("Error with file while maintain");
+        logger.finish();
+        delayed.erase(delayed.begin());
+        res++;
+    }
+    if (delayed.empty() && !swept && (max_paths == 0 || res < max_paths)){ //underfull nodes left by last session
+        logger.init();
+        for (size_t fixed = 1; fixed != 0; res += fixed) //merges may leave parents underfull
+            fixed = repairAll(root, NULL);
+        if (!writeBack())
+            throw std::runtime_error("Error with file while maintain");
+        logger.finish();
+        swept = true;
+    }
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+unsigned long long Btree<Key, Value, min_deg, Agg>::countUnderfull(){
     logger.init();
-    del(root, k, NULL, 0);
-    file.flush();
-    file_vals.flush();
-    if (!file.good() || !file_vals.good())
+    unsigned long long res = countUnderfull(root, true);
+    if (!file.good())
+        throw std::runtime_error("Error with file while countUnderfull");
+    logger.finish();
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+unsigned long long Btree<Key, Value, min_deg, Agg>::countUnderfull(unsigned long long offset, bool is_root){
+    Node n(file, offset, cache);
+    unsigned long long res = (!is_root && n.keys.size() < min_deg - 1);
+    for (size_t i = 0; i < n.refs.size(); i++)
+        res += countUnderfull(n.refs[i], false);
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::restat(Node &n, Node *par){ //n may have moved in par after fix
+    if (par == NULL)
+        return;
+    size_t pos = std::find(par -> refs.begin(), par -> refs.end(), n.offset) - par -> refs.begin();
+    par -> setStat(pos, n.total());
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::delElem(const Key &k){
+    if (buffering()){
+        bufferPut(k, false, Value());
+        return;
+    }
+    remove(k, NULL);
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+bool Btree<Key, Value, min_deg, Agg>::take(const Key &k, Value *v){
+    if (!buffering())
+        return remove(k, v);
+    typename Buffer::iterator it = buffer.find(k);
+    bool res = (it != buffer.end() ? it -> second.first : lookup(k, v));
+    if (res && it != buffer.end())
+        *v = it -> second.second;
+    if (res)
+        bufferPut(k, false, Value());
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+bool Btree<Key, Value, min_deg, Agg>::remove(const Key &k, Value *v){
+    flushIfBuffered();
+    logger.init();
+    endStreak();
+    bool res = del(root, k, NULL, 0, v);
+    if (res && filter_on)
+        filterDel();
+    if (!writeBack())
         throw std::runtime_error("Error with file while delElem");
     logger.finish();
+    if (filter_on && 2 * filter.dels > filter.elems) //deleted keys can't be removed from filter
+        rebuildFilter();
+    return res;
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::del(unsigned long long offset, const Key &k, Node *par, size_t from){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+bool Btree<Key, Value, min_deg, Agg>::del(unsigned long long offset, const Key &k, Node *par, size_t from, Value *v){
+    right_ok = false; //separators may be replaced by delNext
     Node n(file, offset, cache);
     typename std::vector<Key>::iterator it = lower_bound(n.keys.begin(), n.keys.end(), k);
     size_t pos = it - n.keys.begin();
+    bool res = true;
     if (n.isLeaf()){
         if (it == n.keys.end() || *it != k)
-            return;
+            return false;
 
-        delValue(n.vals[pos]);
+        delValue(n.vals[pos].place, v);
+        if (hash_on)
+            hash -> erase(k, &logger);
         n.eraseInLeaf(pos);
     }else{
         if (it != n.keys.end() && *it == k){
-            delValue(n.vals[pos]);
-            std::pair<Key, unsigned long long> next_key = delNext(n.refs[pos + 1], &n, pos + 1, k);
+            delValue(n.vals[pos].place, v);
+            if (hash_on)
+                hash -> erase(k, &logger);
+            std::pair<Key, Val> next_key = delNext(n.refs[pos + 1], &n, pos + 1, k);
+            if (underfull){ //nodes left underfull are on the path to successor, not to k
+                delayed.insert(next_key.first);
+                underfull = false;
+            }
             it = std::find(n.keys.begin(), n.keys.end(), k);
             if (it != n.keys.end())
                 n.replaceKey(it - n.keys.begin(), next_key.first, next_key.second);
         }else
-            del(n.refs[pos], k, &n, pos);
+            res = del(n.refs[pos], k, &n, pos, v);
+    }
+    fixOnDelete(n, par, from);
+    restat(n, par);
+    n.writeNode(file, logger, cache);
+    if (par == NULL && underfull){
+        delayed.insert(k);
+        underfull = false;
+    }
+    return res;
+}
+
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+unsigned long long Btree<Key, Value, min_deg, Agg>::delRange(const Key &l, const Key &r){
+    flushIfBuffered();
+    if (r < l)
+        return 0;
+    logger.init();
+    endStreak();
+    std::vector<Key> seps;
+    unsigned long long res = trim(root, &l, &r, seps, NULL, 0);
+    while (repair(root, l, false, NULL) | repair(root, r, true, NULL)); //merges may leave parents underfull
+    for (size_t i = 0; i < seps.size(); i++)
+        if (del(root, seps[i], NULL, 0))
+            res++;
+    if (filter_on && res != 0){
+        filterDel();
+        filter.dels += res - 1;
+    }
+    if (!writeBack())
+        throw std::runtime_error("Error with file while delRange");
+    logger.finish();
+    if (filter_on && 2 * filter.dels > filter.elems)
+        rebuildFilter();
+    return res;
+}
+
+//removes keys of [l, r] from subtree (NULL bound is open) dropping inner subtrees whole, leaves nodes on the
+//paths to l and r underfull; where the paths split one key of range is kept to join them, it is put in seps
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+unsigned long long Btree<Key, Value, min_deg, Agg>::trim(unsigned long long offset, const Key *l, const Key *r, std::vector<Key> &seps, Node *par, size_t from){
+    right_ok = false;
+    Node n(file, offset, cache);
+    size_t lpos = 0, rpos = n.keys.size();
+    if (l != NULL)
+        lpos = lower_bound(n.keys.begin(), n.keys.end(), *l) - n.keys.begin();
+    if (r != NULL)
+        rpos = upper_bound(n.keys.begin(), n.keys.end(), *r) - n.keys.begin();
+    bool split = (l != NULL && r != NULL && lpos != rpos && !n.isLeaf());
+    size_t last = (split ? rpos - 1 : rpos); //keys [lpos, last) are deleted here
+    unsigned long long res = last - lpos;
+
+    for (size_t i = lpos; i < last; i++){
+        delValue(n.vals[i].place);
+        if (hash_on)
+            hash -> erase(n.keys[i], &logger);
+    }
+    if (!n.isLeaf()){ //children strictly inside range
+        size_t first_ref = (l != NULL ? lpos + 1 : lpos), last_ref = (r != NULL ? rpos : rpos + 1);
+        for (size_t i = first_ref; i < last_ref; i++)
+            res += freeSubtree(n.refs[i]);
+        if (first_ref < last_ref){
+            n.refs.erase(n.refs.begin() + first_ref, n.refs.begin() + last_ref);
+            n.stats.erase(n.stats.begin() + first_ref, n.stats.begin() + last_ref);
+        }
+    }
+    if (lpos != last){
+        n.changed = true;
+        n.keys.erase(n.keys.begin() + lpos, n.keys.begin() + last);
+        n.vals.erase(n.vals.begin() + lpos, n.vals.begin() + last);
+    }
+
+    if (split){
+        seps.emplace_back(n.keys[lpos]);
+        res += trim(n.refs[lpos], l, NULL, seps, &n, lpos);
+        res += trim(n.refs[lpos + 1], NULL, r, seps, &n, lpos + 1);
+    }else if (!n.isLeaf()){
+        res += trim(n.refs[lpos], l, r, seps, &n, lpos);
+    }
+    if (par != NULL)
+        par -> setStat(from, n.total());
+    n.writeNode(file, logger, cache);
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+unsigned long long Btree<Key, Value, min_deg, Agg>::freeSubtree(unsigned long long offset){
+    Node n(file, offset, cache);
+    for (size_t i = 0; i < n.vals.size(); i++){
+        delValue(n.vals[i].place);
+        if (hash_on)
+            hash -> erase(n.keys[i], &logger);
+    }
+    unsigned long long res = n.keys.size();
+    for (size_t i = 0; i < n.refs.size(); i++)
+        res += freeSubtree(n.refs[i]);
+    n.delNode(*this);
+    return res;
+}
+
+//fixes underfull nodes top-down on the path to k, returns whether something was changed
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+bool Btree<Key, Value, min_deg, Agg>::repair(unsigned long long offset, const Key &k, bool upper, Node *par){
+    Node n(file, offset, cache);
+    bool res = false;
+    if (par == NULL){
+        while (n.keys.size() == 0 && !n.isLeaf()){
+            fix(n, NULL, 0);
+            res = true;
+        }
+    }else if (n.keys.size() < min_deg - 1 && par -> refs.size() > 1){
+        while (n.keys.size() < min_deg - 1 && par -> refs.size() > 1)
+            fix(n, par, std::find(par -> refs.begin(), par -> refs.end(), n.offset) - par -> refs.begin());
+        restat(n, par);
+        res = true;
+    }
+    if (!n.isLeaf()){
+        typename std::vector<Key>::iterator it = (upper ? upper_bound(n.keys.begin(), n.keys.end(), k) : lower_bound(n.keys.begin(), n.keys.end(), k));
+        res |= repair(n.refs[it - n.keys.begin()], k, upper, &n);
     }
-    if (n.keys.size() < min_deg - 1)
-        fix(n, par, from);
     n.writeNode(file, logger, cache);
+    return res;
 }
 
+//as repair for every node; children merged while they are walked are left to the next walk
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+size_t Btree<Key, Value, min_deg, Agg>::repairAll(unsigned long long offset, Node *par){
+    Node n(file, offset, cache);
+    size_t res = 0;
+    if (par == NULL){
+        while (n.keys.size() == 0 && !n.isLeaf()){
+            fix(n, NULL, 0);
+            res++;
+        }
+    }else if (n.keys.size() < min_deg - 1 && par -> refs.size() > 1){
+        while (n.keys.size() < min_deg - 1 && par -> refs.size() > 1)
+            fix(n, par, std::find(par -> refs.begin(), par -> refs.end(), n.offset) - par -> refs.begin());
+        restat(n, par);
+        res++;
+    }
+    for (size_t i = 0; i < n.refs.size(); i++)
+        res += repairAll(n.refs[i], &n);
+    n.writeNode(file, logger, cache);
+    return res;
+}
 
-template <typename Key, typename Value, unsigned int min_deg>
-std::pair<Key, unsigned long long> Btree<Key, Value, min_deg>::delNext(unsigned long long offset, Node *par, size_t from, const Key &k){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+std::pair<Key, typename Btree<Key, Value, min_deg, Agg>::Val> Btree<Key, Value, min_deg, Agg>::delNext(unsigned long long offset, Node *par, size_t from, const Key &k){
     Node n(file, offset, cache);
-    std::pair<Key, unsigned long long> res;
+    std::pair<Key, Val> res;
     if (n.isLeaf()){
         res = std::make_pair(n.keys[0], n.vals[0]);
         n.eraseInLeaf(0);
@@ -402,37 +1567,37 @@ std::pair<Key, unsigned long long> Btree<Key, Value, min_deg>::delNext(unsigned
         res = delNext(n.refs[0], &n, 0, k);
     }
 
-    if (n.keys.size() < min_deg - 1)
-        fix(n, par, from);
+    fixOnDelete(n, par, from);
 
     typename std::vector<Key>::iterator it = std::find(n.keys.begin(), n.keys.end(), k);
     if (it != n.keys.end())
         n.replaceKey(it - n.keys.begin(), res.first, res.second);
+    restat(n, par);
     n.writeNode(file, logger, cache);
     return res;
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::Node::eraseInLeaf(size_t pos){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::eraseInLeaf(size_t pos){
     changed = true;
     keys.erase(keys.begin() + pos);
     vals.erase(vals.begin() + pos);
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::Node::replaceKey(size_t pos, const Key &k, unsigned long long v){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::replaceKey(size_t pos, const Key &k, const Val &v){
     changed = true;
     keys[pos] = k;
     vals[pos] = v;
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-bool Btree<Key, Value, min_deg>::Node::isLeaf(){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+bool Btree<Key, Value, min_deg, Agg>::Node::isLeaf(){
     return (refs.size() == 0);
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-char* Btree<Key, Value, min_deg>::Node::getBinary(){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+char* Btree<Key, Value, min_deg, Agg>::Node::getBinary(){
     char* buf = new char[size];
     size_t pos = 0;
 
@@ -464,76 +1629,121 @@ char* Btree<Key, Value, min_deg>::Node::getBinary(){
 
     for (size_t i = 0; i < (2 * min_deg - 2); i++)
         if (i < vals.size()){
-            memcpy(buf + pos, &vals[i], sizeof(unsigned long long));
+            memcpy(buf + pos, &vals[i].place, sizeof(unsigned long long));
             pos += sizeof(unsigned long long);
         }else{
             memset(buf + pos, 0, sizeof(unsigned long long));
             pos += sizeof(unsigned long long);
         }
+
+    for (size_t i = 0; i < (2 * min_deg - 2); i++)
+        if (i < vals.size()){
+            memcpy(buf + pos, &vals[i].agg, agg_size);
+            pos += agg_size;
+        }else{
+            memset(buf + pos, 0, agg_size);
+            pos += agg_size;
+        }
+
+    for (size_t i = 0; i < (2 * min_deg - 1) && Agg::counted; i++)
+        if (i < stats.size()){
+            memcpy(buf + pos, &stats[i].cnt, sizeof(unsigned long long));
+            memcpy(buf + pos + sizeof(unsigned long long), &stats[i].agg, agg_size);
+            pos += stat_size;
+        }else{
+            memset(buf + pos, 0, stat_size);
+            pos += stat_size;
+        }
     return buf;
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::Node::writeNode(std::fstream &f, Logger &logger, Cacher &cache){
-    if (!changed)
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::writeNode(WriteBack &f, Logger &logger, Cacher &cache){
+    if (!changed && stat_lo > stat_hi)
         return;
     char *bin = getBinary();
-    cache.update(offset, bin);
-    logger.log(offset, old, size, false);
-    f.seekp(offset, std::ios_base::beg);
-    f.write(bin, size);
+    size_t from = 0, len = size;
+    if (!changed){ //counts of children on insert path, ancestors are logged and written by these bytes only
+        from = stats_at + stat_lo * stat_size;
+        len = (stat_hi - stat_lo + 1) * stat_size;
+    }
+    cache.update(offset, bin, size);
+    logger.log(offset + from, old + from, len, false);
+    f.write(offset + from, bin + from, len);
+    memcpy(old, bin, size); //node may be kept and changed again
+    changed = false;
+    stat_lo = 2 * min_deg;
+    stat_hi = 0;
     delete [] bin;
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::Node::swap(Node &n){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::swap(Node &n){
     changed = n.changed = true;
     std::swap(offset, n.offset);
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::Node::insertInLeaf(const Key &k, unsigned long long v){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::insertInLeaf(const Key &k, const Val &v){
     changed = true;
     typename std::vector<Key>::iterator it = lower_bound(keys.begin(), keys.end(), k);
     vals.insert(vals.begin() + (it - keys.begin()), v);
     keys.insert(it, k);
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::Node::insert(const Key &k, unsigned long long v, unsigned long long son_offset){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::insert(const Key &k, const Val &v, unsigned long long son_offset, const Stat &son){
     changed = true;
     typename std::vector<Key>::iterator it = lower_bound(keys.begin(), keys.end(), k);
     vals.insert(vals.begin() + (it - keys.begin()), v);
     refs.insert(refs.begin() + (it - keys.begin() + 1), son_offset);
+    stats.insert(stats.begin() + (it - keys.begin() + 1), son);
     keys.insert(it, k);
 }
 
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::setAgg(size_t pos, const AggT &agg){
+    if (!Agg::enabled || memcmp(&vals[pos].agg, &agg, agg_size) == 0)
+        return;
+    changed = true;
+    vals[pos].agg = agg;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::setStat(size_t pos, const Stat &st){
+    if (!Agg::counted || (stats[pos].cnt == st.cnt && memcmp(&stats[pos].agg, &st.agg, agg_size) == 0))
+        return;
+    stats[pos] = st;
+    stat_lo = std::min(stat_lo, pos);
+    stat_hi = std::max(stat_hi, pos);
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+typename Btree<Key, Value, min_deg, Agg>::Stat Btree<Key, Value, min_deg, Agg>::Node::total(){
+    Stat res = {keys.size(), Agg::identity()};
+    for (size_t i = 0; i < refs.size() || i < keys.size(); i++){ //in key order
+        if (i < refs.size()){
+            res.cnt += stats[i].cnt;
+            res.agg = Agg::merge(res.agg, stats[i].agg);
+        }
+        if (i < keys.size())
+            res.agg = Agg::merge(res.agg, vals[i].agg);
+    }
+    return res;
+}
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::Node::delNode(std::fstream &f, Logger &logger, Cacher &cache, unsigned long long &nxt_space){
-    char buf[size];
-    memset(buf, 0, size);
-    memcpy(buf, &nxt_space, sizeof(unsigned long long));
-    cache.update(offset, buf);
-    logger.log(offset, old, size, false);
-    f.seekp(offset, std::ios_base::beg);
-    f.write(buf, size);
 
-    char tmp[sizeof(unsigned long long)];
-    memcpy(tmp, &nxt_space, sizeof(unsigned long long));
-    logger.log(0, tmp, sizeof(unsigned long long), false);
-    memcpy(tmp, &offset, sizeof(unsigned long long));
-    f.seekp(0, std::ios_base::beg);
-    f.write(tmp, sizeof(unsigned long long));
-    nxt_space = offset;
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::Node::delNode(Btree &t){
+    t.release(offset, old, size, false);
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-Btree<Key, Value, min_deg>::Node::Node(std::fstream &f, unsigned long long ps, Cacher &cache):changed(false), offset(ps){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+Btree<Key, Value, min_deg, Agg>::Node::Node(WriteBack &f, unsigned long long ps, Cacher &cache):changed(false), offset(ps),
+        stat_lo(2 * min_deg), stat_hi(0){
     char *res = cache.get(offset);
     if (!res){
-        f.seekg(offset, std::ios_base::beg);
-        f.read(old, size);
+        f.read(offset, old, size);
     }else{
         memcpy(old, res, size);
     }
@@ -553,60 +1763,64 @@ Btree<Key, Value, min_deg>::Node::Node(std::fstream &f, unsigned long long ps, C
         if (i < refs.size())
             keys.emplace_back(k);
     }
-    unsigned long long v;
+    Val v = Val();
     for (size_t i = 1; i < mx; i++){
-        memcpy(&v, old + pos, sizeof(unsigned long long));
+        memcpy(&v.place, old + pos, sizeof(unsigned long long));
         pos += sizeof(unsigned long long);
         if (i < refs.size())
             vals.emplace_back(v);
     }
-    if (!refs.empty() && refs[0] == 1) // is leaf
+    for (size_t i = 0; i < vals.size(); i++)
+        memcpy(&vals[i].agg, old + pos + i * agg_size, agg_size);
+    pos += (mx - 1) * agg_size;
+    if (!refs.empty() && refs[0] == 1){ // is leaf
         refs.clear();
+        return;
+    }
+    Stat st = Stat();
+    for (size_t i = 0; i < refs.size(); i++){
+        if (Agg::counted){
+            memcpy(&st.cnt, old + pos, sizeof(unsigned long long));
+            memcpy(&st.agg, old + pos + sizeof(unsigned long long), agg_size);
+            pos += stat_size;
+        }
+        stats.emplace_back(st);
+    }
 }
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::writeValue(unsigned long long offset, const Value &val, bool new_val){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::writeValue(unsigned long long offset, const Value &val, bool new_val, const char *old_bin){
     char buf[size_value];
     memset(buf, 0, size_value);
-    if (!new_val){
+    if (old_bin != NULL){
+        memcpy(buf, old_bin, size_value);
+    }else if (!new_val){
         char *old = getValueBin(offset);
         memcpy(buf, old, size_value);
         delete[] old;
     }
     logger.log(offset, buf, size_value, true);
+    touched = true;
 
     memset(buf, 0, size_value);
     memcpy(buf, &val, sizeof(Value));
-    file_vals.seekp(offset, std::ios_base::beg);
-    file_vals.write(buf, size_value);
+    file_vals.write(offset, buf, size_value);
+    vals_cache.update(offset, buf, size_value);
 }
 
 
-template <typename Key, typename Value, unsigned int min_deg>
-void Btree<Key, Value, min_deg>::delValue(unsigned long long offset){
-    char buf[size_value], old[size_value];
-    memset(buf, 0, size_value);
-    memcpy(buf, &nxt_space_vals, sizeof(unsigned long long));
-
-    memset(old, 0, size_value);
-    char *last = getValueBin(offset);
-    memcpy(old, last, size_value);
-    delete[] last;
-    logger.log(offset, old, size_value, true);
-    file_vals.seekp(offset, std::ios_base::beg);
-    file_vals.write(buf, size_value);
-
-    char tmp[sizeof(unsigned long long)];
-    memcpy(tmp, &nxt_space_vals, sizeof(unsigned long long));
-    logger.log(0, tmp, sizeof(unsigned long long), true);
-    memcpy(tmp, &offset, sizeof(unsigned long long));
-    file_vals.seekp(0, std::ios_base::beg);
-    file_vals.write(tmp, sizeof(unsigned long long));
-    nxt_space_vals = offset;
-}
-
-template <typename Key, typename Value, unsigned int min_deg>
-Btree<Key, Value, min_deg>::Node::Node(){
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+void Btree<Key, Value, min_deg, Agg>::delValue(unsigned long long offset, Value *v){
+    char *old = getValueBin(offset);
+    if (v != NULL)
+        memcpy((char*)v, old, sizeof(Value));
+    touched = true;
+    release(offset, old, size_value, true);
+    delete[] old;
+}
+
+template <typename Key, typename Value, unsigned int min_deg, typename Agg>
+Btree<Key, Value, min_deg, Agg>::Node::Node():stat_lo(2 * min_deg), stat_hi(0){
     memset(old, 0, size);
 }
 
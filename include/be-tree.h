@@ -0,0 +1,509 @@
+#ifndef BETREE_H_
+#define BETREE_H_
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <exception>
+
+#include "cacher.h"
+#include "logger.h"
+#include "write-back.h"
+#include "database.h"
+
+//upsert messages carry an argument: apply makes new value from current one (NULL if key is absent),
+//combine joins arguments of two pending upserts of one key
+template <typename Value>
+struct AddUpsert{
+    static Value apply(const Value *cur, const Value &arg){ return cur == NULL ? arg : *cur + arg; }
+    static Value combine(const Value &older, const Value &newer){ return older + newer; }
+};
+
+//write-optimised variant: internal nodes keep a buffer of pending put/delete/upsert messages which are pushed
+//one level down in batches, to the child that gets most of them, only when the buffer is full;
+//nodes left small by deletes are joined with a neighbour and freed nodes are reused, as in Btree
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd = AddUpsert<Value> > //up to fanout children and buf_size messages in node
+class BeTree: private TreeBase{
+ public:
+    static_assert(fanout >= 2, "Should be at least two children");
+    static_assert(buf_size >= 1, "Should be place for messages");
+
+    BeTree(); //single tree in betree.main, betree.vals and betree.log
+    BeTree(Database &db, const char *name); //tree called name among trees of db, created if needed
+    ~BeTree(){}
+
+    void addElem(const Key &k, const Value &v);
+    void delElem(const Key &k);
+    void upsert(const Key &k, const Value &arg); //value becomes Upd::apply of current value and arg, no read is done
+    bool findElem(const Key &k, Value *v);
+    void getElems(const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res);
+
+ private:
+    enum{del_msg = 0, put_msg = 1, upsert_msg = 2};
+
+    struct Msg{
+        Key k;
+        Value v; //argument for upsert
+        unsigned char type;
+    };
+
+    class Node{
+     public:
+        Node(WriteBack &f, unsigned long long offset, Cacher &cache);
+        Node();
+
+        void writeNode(WriteBack &f, Logger &logger, Cacher &cache);
+        void delNode(BeTree &t);
+        size_t child(const Key &k); //child where k belongs
+        size_t findMsg(const Key &k); //first message with key not less than k
+        void addMsg(const Msg &m);
+        void apply(const Msg &m); //for leaf
+        bool overflow();
+        bool small(); //should be joined with neighbour
+
+        const static size_t head = 3 * sizeof(unsigned long long);
+        const static size_t size = head + (fanout - 1) * sizeof(Key) + fanout * sizeof(unsigned long long) + buf_size * (1 + sizeof(Key) + sizeof(Value));
+        const static size_t leaf_cap = (size - head) / (sizeof(Key) + sizeof(Value));
+        bool changed, leaf;
+        unsigned long long offset;
+        std::vector<Key> keys; //pivots for internal node: keys of child i are in [keys[i - 1], keys[i])
+        std::vector<Value> vals; //only in leaf
+        std::vector<unsigned long long> refs;
+        std::vector<Msg> msgs; //sorted by key, one for key
+
+     private:
+        char* getBinary();
+        char old[size];
+    };
+
+    static void combine(Msg &older, const Msg &newer); //older becomes both of them
+    void put(const Msg &m);
+    void flush(Node &n);
+    bool join(Node &n, size_t pos, Node &c);
+    std::vector<std::pair<Key, unsigned long long> > split(Node &n);
+    void get(unsigned long long offset, const Key &l, const Key &r, std::map<Key, Value> &res);
+
+    BeTree(const BeTree &b);
+    void operator= (const BeTree &b);
+};
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+BeTree<Key, Value, fanout, buf_size, Upd>::BeTree():TreeBase(new Database("betree.main", "betree.vals", "betree.log"), "betree", Node::size, sizeof(Value)){}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+BeTree<Key, Value, fanout, buf_size, Upd>::BeTree(Database &db, const char *name):TreeBase(db, name, Node::size, sizeof(Value)){}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::addElem(const Key &k, const Value &v){
+    Msg m = {k, v, put_msg};
+    put(m);
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::delElem(const Key &k){
+    Msg m = {k, Value(), del_msg};
+    put(m);
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::upsert(const Key &k, const Value &arg){
+    Msg m = {k, arg, upsert_msg};
+    put(m);
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::combine(Msg &older, const Msg &newer){
+    if (newer.type != upsert_msg){
+        older = newer;
+    }else if (older.type == upsert_msg){
+        older.v = Upd::combine(older.v, newer.v);
+    }else{
+        older.v = Upd::apply(older.type == put_msg ? &older.v : NULL, newer.v);
+        older.type = put_msg;
+    }
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::put(const Msg &m){
+    logger.init();
+    touched = true;
+    Node n(file, root, cache);
+    if (n.leaf){
+        n.apply(m);
+    }else{
+        n.addMsg(m);
+        if (n.msgs.size() > buf_size)
+            flush(n);
+    }
+
+    while (n.overflow()){ //root stays in its place, its content is moved to new node
+        Node moved;
+        moved.changed = true;
+        moved.leaf = n.leaf;
+        std::swap(moved.keys, n.keys);
+        std::swap(moved.vals, n.vals);
+        std::swap(moved.refs, n.refs);
+        std::swap(moved.msgs, n.msgs);
+        std::vector<std::pair<Key, unsigned long long> > parts = split(moved);
+        moved.offset = allocate(false); //after parts, place at end of file is taken only by write
+        moved.writeNode(file, logger, cache);
+
+        n.leaf = false;
+        n.changed = true;
+        n.refs.emplace_back(moved.offset);
+        for (size_t i = 0; i < parts.size(); i++){
+            n.keys.emplace_back(parts[i].first);
+            n.refs.emplace_back(parts[i].second);
+        }
+    }
+    while (!n.leaf && n.refs.size() == 1 && n.msgs.empty()){ //only child moves to root
+        Node c(file, n.refs[0], cache);
+        n.changed = true;
+        n.leaf = c.leaf;
+        std::swap(n.keys, c.keys);
+        std::swap(n.vals, c.vals);
+        std::swap(n.refs, c.refs);
+        std::swap(n.msgs, c.msgs);
+        c.delNode(*this);
+    }
+    n.writeNode(file, logger, cache);
+
+    if (!writeBack())
+        throw std::runtime_error("Error with file while put");
+    logger.finish();
+}
+
+//moves messages for the child that has most of them
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::flush(Node &n){
+    std::vector<size_t> cnt(n.refs.size(), 0);
+    for (size_t i = 0; i < n.msgs.size(); i++)
+        cnt[n.child(n.msgs[i].k)]++;
+    size_t pos = std::max_element(cnt.begin(), cnt.end()) - cnt.begin();
+    size_t lo = 0;
+    while (n.child(n.msgs[lo].k) != pos)
+        lo++;
+    size_t hi = lo + cnt[pos];
+
+    Node c(file, n.refs[pos], cache);
+    for (size_t i = lo; i < hi; i++)
+        if (c.leaf)
+            c.apply(n.msgs[i]);
+        else
+            c.addMsg(n.msgs[i]);
+    n.msgs.erase(n.msgs.begin() + lo, n.msgs.begin() + hi);
+    n.changed = true;
+    while (!c.leaf && c.msgs.size() > buf_size)
+        flush(c);
+
+    if (c.overflow()){
+        std::vector<std::pair<Key, unsigned long long> > parts = split(c);
+        for (size_t i = 0; i < parts.size(); i++){
+            n.keys.insert(n.keys.begin() + pos + i, parts[i].first);
+            n.refs.insert(n.refs.begin() + pos + i + 1, parts[i].second);
+        }
+    }else if (c.small() && n.refs.size() > 1 && join(n, pos, c)){
+        return;
+    }
+    c.writeNode(file, logger, cache);
+}
+
+//puts child c at pos and its neighbour in one node if they fit, the right one of them is freed
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+bool BeTree<Key, Value, fanout, buf_size, Upd>::join(Node &n, size_t pos, Node &c){
+    size_t other = (pos + 1 < n.refs.size() ? pos + 1 : pos - 1), l = std::min(pos, other);
+    Node s(file, n.refs[other], cache);
+    Node &left = (l == pos ? c : s), &right = (l == pos ? s : c);
+    if (left.leaf && left.keys.size() + right.keys.size() > Node::leaf_cap)
+        return false;
+    if (!left.leaf && (left.refs.size() + right.refs.size() > fanout || left.msgs.size() + right.msgs.size() > buf_size))
+        return false;
+
+    left.changed = n.changed = true;
+    if (!left.leaf)
+        left.keys.emplace_back(n.keys[l]);
+    left.keys.insert(left.keys.end(), right.keys.begin(), right.keys.end());
+    left.vals.insert(left.vals.end(), right.vals.begin(), right.vals.end());
+    left.refs.insert(left.refs.end(), right.refs.begin(), right.refs.end());
+    left.msgs.insert(left.msgs.end(), right.msgs.begin(), right.msgs.end());
+    n.keys.erase(n.keys.begin() + l);
+    n.refs.erase(n.refs.begin() + l + 1);
+    left.writeNode(file, logger, cache);
+    right.delNode(*this);
+    return true;
+}
+
+//cuts n into parts which fit in node, returns pivots and offsets of new right parts
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+std::vector<std::pair<Key, unsigned long long> > BeTree<Key, Value, fanout, buf_size, Upd>::split(Node &n){
+    std::vector<std::pair<Key, unsigned long long> > res;
+    size_t total = (n.leaf ? n.keys.size() : n.refs.size()), cap = (n.leaf ? Node::leaf_cap : fanout);
+    size_t parts = (total + cap - 1) / cap, per = (total + parts - 1) / parts;
+
+    for (size_t from = per; from < total; from += per){
+        size_t to = std::min(total, from + per);
+        Node part;
+        part.offset = allocate(false);
+        part.changed = true;
+        part.leaf = n.leaf;
+        if (n.leaf){
+            part.keys.assign(n.keys.begin() + from, n.keys.begin() + to);
+            part.vals.assign(n.vals.begin() + from, n.vals.begin() + to);
+            res.emplace_back(n.keys[from], part.offset);
+        }else{
+            part.keys.assign(n.keys.begin() + from, n.keys.begin() + to - 1);
+            part.refs.assign(n.refs.begin() + from, n.refs.begin() + to);
+            Key pivot = n.keys[from - 1];
+            for (size_t i = 0; i < n.msgs.size(); i++)
+                if (!(n.msgs[i].k < pivot) && (to == total || n.msgs[i].k < n.keys[to - 1]))
+                    part.msgs.emplace_back(n.msgs[i]);
+            res.emplace_back(pivot, part.offset);
+        }
+        part.writeNode(file, logger, cache);
+    }
+
+    n.changed = true;
+    if (n.leaf){
+        n.keys.resize(per);
+        n.vals.resize(per);
+    }else{
+        n.msgs.resize(n.findMsg(n.keys[per - 1]));
+        n.keys.resize(per - 1);
+        n.refs.resize(per);
+    }
+    return res;
+}
+
+//first put or delete met on the way down is the newest, upserts met before it are applied to it from the oldest
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+bool BeTree<Key, Value, fanout, buf_size, Upd>::findElem(const Key &k, Value *v){
+    logger.init();
+    std::vector<Value> ups; //newest first
+    unsigned long long offset = root;
+    bool res = false;
+    while (true){
+        Node n(file, offset, cache);
+        if (n.leaf){
+            typename std::vector<Key>::iterator it = lower_bound(n.keys.begin(), n.keys.end(), k);
+            res = (it != n.keys.end() && *it == k);
+            if (res)
+                *v = n.vals[it - n.keys.begin()];
+            break;
+        }
+        size_t pos = n.findMsg(k);
+        if (pos < n.msgs.size() && n.msgs[pos].k == k){
+            if (n.msgs[pos].type != upsert_msg){
+                res = (n.msgs[pos].type == put_msg);
+                if (res)
+                    *v = n.msgs[pos].v;
+                break;
+            }
+            ups.emplace_back(n.msgs[pos].v);
+        }
+        offset = n.refs[n.child(k)];
+    }
+    for (size_t i = ups.size(); i-- > 0; res = true)
+        *v = Upd::apply(res ? v : NULL, ups[i]);
+    if (!file.good())
+        throw std::runtime_error("Error with file while findElem");
+    logger.finish();
+    return res;
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::getElems(const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res){
+    if (r < l)
+        return;
+    std::map<Key, Value> found;
+    logger.init();
+    get(root, l, r, found);
+    if (!file.good())
+        throw std::runtime_error("Error with file while getElems");
+    logger.finish();
+    res.insert(res.end(), found.begin(), found.end());
+}
+
+//children are applied before messages of node, because messages are newer
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::get(unsigned long long offset, const Key &l, const Key &r, std::map<Key, Value> &res){
+    Node n(file, offset, cache);
+    if (n.leaf){
+        for (size_t i = lower_bound(n.keys.begin(), n.keys.end(), l) - n.keys.begin(); i < n.keys.size() && !(r < n.keys[i]); i++)
+            res[n.keys[i]] = n.vals[i];
+        return;
+    }
+    for (size_t i = n.child(l); i <= n.child(r); i++)
+        get(n.refs[i], l, r, res);
+    for (size_t i = n.findMsg(l); i < n.msgs.size() && !(r < n.msgs[i].k); i++){
+        const Msg &m = n.msgs[i];
+        typename std::map<Key, Value>::iterator it = res.find(m.k);
+        if (m.type == put_msg)
+            res[m.k] = m.v;
+        else if (m.type == upsert_msg)
+            res[m.k] = Upd::apply(it == res.end() ? NULL : &it -> second, m.v);
+        else if (it != res.end())
+            res.erase(it);
+    }
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+size_t BeTree<Key, Value, fanout, buf_size, Upd>::Node::child(const Key &k){
+    return upper_bound(keys.begin(), keys.end(), k) - keys.begin();
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+size_t BeTree<Key, Value, fanout, buf_size, Upd>::Node::findMsg(const Key &k){
+    size_t l = 0, r = msgs.size();
+    while (l < r){
+        size_t m = (l + r) / 2;
+        if (msgs[m].k < k)
+            l = m + 1;
+        else
+            r = m;
+    }
+    return l;
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::Node::addMsg(const Msg &m){
+    changed = true;
+    size_t pos = findMsg(m.k);
+    if (pos < msgs.size() && msgs[pos].k == m.k)
+        combine(msgs[pos], m);
+    else
+        msgs.insert(msgs.begin() + pos, m);
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::Node::apply(const Msg &m){
+    typename std::vector<Key>::iterator it = lower_bound(keys.begin(), keys.end(), m.k);
+    size_t pos = it - keys.begin();
+    bool exists = (it != keys.end() && *it == m.k);
+    if (m.type != del_msg){
+        changed = true;
+        Value v = (m.type == put_msg ? m.v : Upd::apply(exists ? &vals[pos] : NULL, m.v));
+        if (exists){
+            vals[pos] = v;
+        }else{
+            keys.insert(it, m.k);
+            vals.insert(vals.begin() + pos, v);
+        }
+    }else if (exists){
+        changed = true;
+        keys.erase(it);
+        vals.erase(vals.begin() + pos);
+    }
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+bool BeTree<Key, Value, fanout, buf_size, Upd>::Node::overflow(){
+    return (leaf ? keys.size() > leaf_cap : refs.size() > fanout);
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+bool BeTree<Key, Value, fanout, buf_size, Upd>::Node::small(){
+    return (leaf ? 4 * keys.size() < leaf_cap : refs.size() == 1 || 4 * refs.size() < fanout);
+}
+
+//page: internal node flag, number of keys, number of messages, then
+//for leaf: keys and values, for internal node: pivots, refs and messages; zero page is empty leaf
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+char* BeTree<Key, Value, fanout, buf_size, Upd>::Node::getBinary(){
+    char* buf = new char[size];
+    memset(buf, 0, size);
+    unsigned long long h[3] = {!leaf, keys.size(), msgs.size()};
+    memcpy(buf, h, head);
+    size_t pos = head;
+
+    if (leaf){
+        for (size_t i = 0; i < keys.size(); i++){
+            memcpy(buf + pos, &keys[i], sizeof(Key));
+            memcpy(buf + pos + sizeof(Key), &vals[i], sizeof(Value));
+            pos += sizeof(Key) + sizeof(Value);
+        }
+        return buf;
+    }
+
+    for (size_t i = 0; i < keys.size(); i++)
+        memcpy(buf + pos + i * sizeof(Key), &keys[i], sizeof(Key));
+    pos += (fanout - 1) * sizeof(Key);
+    for (size_t i = 0; i < refs.size(); i++)
+        memcpy(buf + pos + i * sizeof(unsigned long long), &refs[i], sizeof(unsigned long long));
+    pos += fanout * sizeof(unsigned long long);
+    for (size_t i = 0; i < msgs.size(); i++){
+        buf[pos] = msgs[i].type;
+        memcpy(buf + pos + 1, &msgs[i].k, sizeof(Key));
+        memcpy(buf + pos + 1 + sizeof(Key), &msgs[i].v, sizeof(Value));
+        pos += 1 + sizeof(Key) + sizeof(Value);
+    }
+    return buf;
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::Node::writeNode(WriteBack &f, Logger &logger, Cacher &cache){
+    if (!changed)
+        return;
+    char *bin = getBinary();
+    cache.update(offset, bin, size);
+    logger.log(offset, old, size, false);
+    f.write(offset, bin, size);
+    delete [] bin;
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+void BeTree<Key, Value, fanout, buf_size, Upd>::Node::delNode(BeTree &t){
+    t.release(offset, old, size, false);
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+BeTree<Key, Value, fanout, buf_size, Upd>::Node::Node(WriteBack &f, unsigned long long ps, Cacher &cache):changed(false), offset(ps){
+    char *res = cache.get(offset);
+    if (!res){
+        f.read(offset, old, size);
+    }else{
+        memcpy(old, res, size);
+    }
+    unsigned long long h[3];
+    memcpy(h, old, head);
+    leaf = (h[0] == 0);
+    size_t pos = head;
+    Key k;
+    Value v;
+
+    if (leaf){
+        for (size_t i = 0; i < h[1]; i++){
+            memcpy((char*)&k, old + pos, sizeof(Key));
+            memcpy((char*)&v, old + pos + sizeof(Key), sizeof(Value));
+            keys.emplace_back(k);
+            vals.emplace_back(v);
+            pos += sizeof(Key) + sizeof(Value);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < h[1]; i++){
+        memcpy((char*)&k, old + pos + i * sizeof(Key), sizeof(Key));
+        keys.emplace_back(k);
+    }
+    pos += (fanout - 1) * sizeof(Key);
+    refs.resize(h[1] + 1);
+    memcpy(&refs[0], old + pos, refs.size() * sizeof(unsigned long long));
+    pos += fanout * sizeof(unsigned long long);
+    Msg m;
+    for (size_t i = 0; i < h[2]; i++){
+        m.type = old[pos];
+        memcpy((char*)&m.k, old + pos + 1, sizeof(Key));
+        memcpy((char*)&m.v, old + pos + 1 + sizeof(Key), sizeof(Value));
+        msgs.emplace_back(m);
+        pos += 1 + sizeof(Key) + sizeof(Value);
+    }
+}
+
+template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd>
+BeTree<Key, Value, fanout, buf_size, Upd>::Node::Node():changed(false), leaf(true), offset(0){
+    memset(old, 0, size);
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef BLOOM_H_
+#define BLOOM_H_
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <type_traits>
+#include <stdexcept>
+
+unsigned long long hashBytes(const char *data, size_t sz);
+
+//equal keys must give equal hashes, so bytes are hashed only for types where they are same for same value;
+//floats and pairs are hashed by value and by fields, other keys with padding need own hashKey overload
+//found by argument dependent lookup, only if they are used with filter or hash index
+template <typename T>
+struct UniqueBytes{ //same value always has same bytes
+    const static bool value = __has_unique_object_representations(T);
+};
+
+template <typename T>
+typename std::enable_if<UniqueBytes<T>::value, unsigned long long>::type hashKey(const T &k){
+    return hashBytes((const char*)&k, sizeof(T));
+}
+
+inline unsigned long long hashKey(double k){
+    if (k == 0) //-0.0
+        k = 0;
+    return hashBytes((const char*)&k, sizeof(double));
+}
+
+inline unsigned long long hashKey(float k){
+    return hashKey((double)k);
+}
+
+template <typename A, typename B>
+auto hashKey(const std::pair<A, B> &k) -> decltype(hashKey(k.first), hashKey(k.second), 0ULL){
+    unsigned long long h[2] = {hashKey(k.first), hashKey(k.second)};
+    return hashBytes((const char*)h, sizeof(h));
+}
+
+template <typename T>
+struct HasHashKey{
+    template <typename U>
+    static char test(decltype(hashKey(std::declval<const U&>())) *);
+    template <typename U>
+    static long test(...);
+    const static bool value = sizeof(test<T>(0)) == 1;
+};
+
+//hash of key for trees, keys without hashKey compile until filter or hash index is enabled for them
+template <typename T, bool has = HasHashKey<T>::value>
+struct KeyHash{
+    static unsigned long long get(const T &k){
+        return hashKey(k);
+    }
+};
+
+template <typename T>
+struct KeyHash<T, false>{
+    static unsigned long long get(const T &){
+        throw std::runtime_error("Key has no hashKey");
+    }
+};
+
+class Bloom{
+ public:
+    Bloom();
+    void reset(size_t expected);
+    void add(unsigned long long h);
+    bool mayContain(unsigned long long h);
+    bool load(const char *name, unsigned long long stamp); //false if file is missing, dirty, of other stamp or format
+    bool save(const char *name, unsigned long long stamp);
+    bool markDirty(const char *name); //false if file can't be marked
+
+    unsigned long long elems, dels; //inserted keys since rebuild (and at rebuild), deleted keys since rebuild
+    size_t capacity;
+
+ private:
+    Bloom(const Bloom &b);
+    void operator =(const Bloom &b);
+
+    std::vector<unsigned long long> bits;
+    bool dirty;
+    const static unsigned long long magic = 0x32424d4f4c424545ULL; //changed with hash of keys
+    const size_t bits_per_key = 10;
+    const size_t num_hashes = 7;
+};
+
+#endif
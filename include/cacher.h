@@ -2,21 +2,38 @@
 #define CACHER_H_
 
 #include <map>
+#include <list>
 
+//binary blocks by offset, least recently used block is evicted when over the memory budget
 class Cacher{
  public:
-    Cacher(size_t sz);
+    Cacher(size_t sz, size_t max_size = (1<<25)); //32 MB by default, sz is size of block if not given in update
     ~Cacher();
     void update(unsigned long long offset, char* bin);
+    void update(unsigned long long offset, char* bin, size_t len);
     char* get(unsigned long long offset);
+    void erase(unsigned long long offset);
+    void setMaxSize(size_t new_max); //0 turns caching off
+    void clear();
+
+    unsigned long long hits, misses; //statistics of get
 
  private:
     Cacher(const Cacher &c);
     void operator =(const Cacher &c);
 
-    std::map<unsigned long long, char*> store;
-    size_t sz;
-    const size_t max_size = (1<<25); //32 MB
+    struct Entry{
+        char *bin;
+        size_t len;
+        std::list<unsigned long long>::iterator pos; //place in usage order
+    };
+
+    void shrink();
+
+    std::map<unsigned long long, Entry> store;
+    std::list<unsigned long long> order; //most recently used first
+    size_t sz, used;
+    size_t max_size;
 };
 
 #endif
@@ -0,0 +1,100 @@
+#ifndef DATABASE_H_
+#define DATABASE_H_
+
+#include <string>
+#include <vector>
+
+#include "cacher.h"
+#include "logger.h"
+#include "write-back.h"
+
+class TreeBase;
+
+//files, caches and log shared by named trees, possibly of different types, opened with Btree(db, name)
+//or BeTree(db, name);
+//changes of all trees between begin and commit are written and undone together, they are dropped
+//by abort or if database is closed before commit; write buffers of trees are flushed by begin and not used
+//until commit or abort
+class Database{
+ public:
+    Database(const char *name); //files name.main, name.vals and name.log are created if needed
+    ~Database(){}
+
+    void begin();
+    void commit();
+    void abort();
+    void setCacheSize(size_t bytes); //for nodes of all trees
+    void setValueCacheSize(size_t bytes);
+
+ private:
+    friend class TreeBase;
+    template <typename Key, typename Value, unsigned int min_deg, typename Agg> friend class Btree;
+    template <typename Key, typename Value, unsigned int fanout, unsigned int buf_size, typename Upd> friend class BeTree;
+
+    Database(const char *main, const char *vals, const char *log, const char *hash = NULL); //files of single tree
+    void open(); //checks or writes catalog
+    unsigned long long openTree(const char *tree, size_t node_size, size_t value_size); //place of tree root in catalog
+    bool writeBack(); //nothing is written until commit inside transaction
+    bool commitFiles(); //of database and of its trees, after log records
+    static std::string createFiles(const char *name);
+
+    Database(const Database &d);
+    void operator =(const Database &d);
+
+    //catalog in first page of main file: magic, version of format, number of trees, entries of name, root,
+    //free list head, place of free list head in values file, node size, value size, generation
+    const static unsigned long long magic = 0x6174616462656572ULL;
+    const static unsigned long long version = 2; //changed with layout of catalog or nodes, other versions are rejected
+    const static size_t catalog_head = 3 * sizeof(unsigned long long);
+    const static size_t catalog_size = 4096;
+    const static size_t name_size = 40;
+    const static size_t entry_size = name_size + 6 * sizeof(unsigned long long);
+
+    std::string name; //empty for files of single Btree
+    Logger logger;
+    WriteBack file, file_vals;
+    Cacher cache, vals_cache;
+    std::vector<TreeBase*> trees; //opened trees, told about commit and abort
+};
+
+//tree kept in database: root, free lists of main and values files and generation from its catalog entry,
+//base of Btree and BeTree
+class TreeBase{
+ protected:
+    TreeBase(Database *own, const char *name, size_t node_size, size_t value_size); //own database is deleted with tree
+    TreeBase(Database &db, const char *name, size_t node_size, size_t value_size);
+    virtual ~TreeBase();
+
+    virtual bool commitFiles(); //files of tree besides database ones, before log of operation is ended
+    virtual void beforeBegin(); //before transaction is started
+    virtual void abort(); //changes of transaction were dropped, catalog fields are read again
+
+    unsigned long long allocate(bool is_value); //place from free list or at end of file
+    void release(unsigned long long offset, const char *old, size_t size, bool is_value); //old image is logged
+    bool writeBack(); //bumps generation if tree was touched and its generation was given as stamp
+    unsigned long long stamp(); //generation for copies of tree, like saved filter; next change bumps it
+
+    Database *own;
+    Database &db;
+    Logger &logger;
+    WriteBack &file, &file_vals; //pages of operation are written at its end
+    Cacher &cache, &vals_cache;
+
+    unsigned long long root; //node at this offset stays root
+    unsigned long long nxt_space, nxt_space_vals; //heads of free lists
+    unsigned long long head_main, head_vals; //where free list heads are kept in main and values files
+    unsigned long long generation, head_gen; //number of committed changes of tree, kept in catalog at head_gen
+    bool touched; //operation changed tree, generation is bumped on write back
+    bool bumped; //generation was bumped after it was last given as stamp, so it isn't bumped again
+
+ private:
+    friend class Database;
+
+    void open(const char *name, size_t node_size, size_t value_size);
+    void readState();
+
+    TreeBase(const TreeBase &t);
+    void operator =(const TreeBase &t);
+};
+
+#endif
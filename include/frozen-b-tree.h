@@ -0,0 +1,170 @@
+#ifndef FROZEN_BTREE_H_
+#define FROZEN_BTREE_H_
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//read-only tree made by Btree::freeze: header page, then levels of keys cut in page blocks, then values.
+//level 0 has all keys in order, key j of level h + 1 is first key of block j of level h, top level is one
+//block; values are kept apart in key order, so a lookup reads one page of keys on each level and one value
+//file is mapped read-only and nothing is changed on reading, so it can be shared by threads and processes
+
+const unsigned long long frozen_magic = 0x325a4f5246454552ULL;
+const size_t frozen_page = 4096;
+
+//places of levels and values for n keys, same for writer and reader
+struct FrozenLayout{
+    FrozenLayout(unsigned long long n, size_t key_size, size_t value_size);
+    unsigned long long keyPlace(size_t level, unsigned long long i) const;
+
+    size_t key_size;
+    unsigned long long per_block, stride; //keys in block, bytes from block to next one
+    std::vector<unsigned long long> cnt, start; //number of keys and offset of levels
+    unsigned long long vals, total; //offset of values, size of file
+};
+
+inline FrozenLayout::FrozenLayout(unsigned long long n, size_t key_size, size_t value_size):key_size(key_size){
+    per_block = std::max<unsigned long long>(frozen_page / key_size, 2);
+    stride = (per_block * key_size + frozen_page - 1) / frozen_page * frozen_page;
+    cnt.push_back(n);
+    while (cnt.back() > per_block)
+        cnt.push_back((cnt.back() + per_block - 1) / per_block);
+    unsigned long long pos = frozen_page;
+    for (size_t h = 0; h < cnt.size(); h++){
+        start.push_back(pos);
+        pos += (cnt[h] + per_block - 1) / per_block * stride;
+    }
+    vals = pos;
+    total = vals + n * value_size;
+}
+
+inline unsigned long long FrozenLayout::keyPlace(size_t level, unsigned long long i) const{
+    return start[level] + i / per_block * stride + i % per_block * key_size;
+}
+
+template <typename Key, typename Value>
+class FrozenBtree{
+ public:
+    FrozenBtree(const char *name);
+    ~FrozenBtree();
+
+    bool findElem(const Key &k, Value *v) const;
+    void getElems(const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res) const;
+    unsigned long long size() const;
+
+ private:
+    FrozenBtree(const FrozenBtree &b);
+    void operator= (const FrozenBtree &b);
+
+    Key key(size_t level, unsigned long long i) const;
+    Value value(unsigned long long i) const;
+    unsigned long long lowerBound(const Key &k) const; //n if all keys are less
+
+    const char *data;
+    size_t map_size;
+    unsigned long long n;
+    FrozenLayout *layout;
+};
+
+template <typename Key, typename Value>
+FrozenBtree<Key, Value>::FrozenBtree(const char *name):layout(NULL){
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < frozen_page){
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error("Error on opening frozen tree");
+    }
+    map_size = st.st_size;
+    void *p = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        throw std::runtime_error("Error on mapping frozen tree");
+    data = (const char*)p;
+
+    unsigned long long head[5];
+    memcpy(head, data, sizeof(head));
+    n = head[1];
+    if (head[0] == frozen_magic && head[2] == sizeof(Key) && head[3] == sizeof(Value))
+        layout = new FrozenLayout(n, sizeof(Key), sizeof(Value));
+    if (layout == NULL || head[4] != layout -> per_block || layout -> total > map_size){
+        delete layout;
+        munmap((void*)data, map_size);
+        throw std::runtime_error("Wrong format of frozen tree");
+    }
+}
+
+template <typename Key, typename Value>
+FrozenBtree<Key, Value>::~FrozenBtree(){
+    delete layout;
+    munmap((void*)data, map_size);
+}
+
+template <typename Key, typename Value>
+unsigned long long FrozenBtree<Key, Value>::size() const{
+    return n;
+}
+
+template <typename Key, typename Value>
+Key FrozenBtree<Key, Value>::key(size_t level, unsigned long long i) const{
+    Key k;
+    memcpy((char*)&k, data + layout -> keyPlace(level, i), sizeof(Key));
+    return k;
+}
+
+template <typename Key, typename Value>
+Value FrozenBtree<Key, Value>::value(unsigned long long i) const{
+    Value v;
+    memcpy((char*)&v, data + layout -> vals + i * sizeof(Value), sizeof(Value));
+    return v;
+}
+
+//on each level: binary search in one block, then go to the block of last key less than k
+template <typename Key, typename Value>
+unsigned long long FrozenBtree<Key, Value>::lowerBound(const Key &k) const{
+    unsigned long long block = 0;
+    for (size_t h = layout -> cnt.size(); h-- > 0;){
+        unsigned long long from = block * layout -> per_block;
+        unsigned long long lo = 0, hi = std::min(layout -> per_block, layout -> cnt[h] - from);
+        while (lo < hi){
+            unsigned long long mid = (lo + hi) / 2;
+            if (key(h, from + mid) < k)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (h == 0)
+            return from + lo;
+        block = from + (lo == 0 ? 0 : lo - 1);
+    }
+    return n;
+}
+
+template <typename Key, typename Value>
+bool FrozenBtree<Key, Value>::findElem(const Key &k, Value *v) const{
+    unsigned long long i = lowerBound(k);
+    if (i == n || !(key(0, i) == k))
+        return false;
+    *v = value(i);
+    return true;
+}
+
+template <typename Key, typename Value>
+void FrozenBtree<Key, Value>::getElems(const Key &l, const Key &r, std::vector<std::pair<Key, Value> > &res) const{
+    for (unsigned long long i = lowerBound(l); i < n; i++){
+        Key k = key(0, i);
+        if (r < k)
+            break;
+        res.emplace_back(k, value(i));
+    }
+}
+
+#endif
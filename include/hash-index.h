@@ -0,0 +1,288 @@
+#ifndef HASH_INDEX_H_
+#define HASH_INDEX_H_
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+
+#include "bloom.h"
+#include "cacher.h"
+#include "logger.h"
+#include "write-back.h"
+
+//extendible hashing from key to value offset; buckets are never merged, directory is rebuilt from
+//bucket headers on load, bucket pages are kept in LRU cache
+template <typename Key>
+class HashIndex{
+ public:
+    HashIndex(const char *name);
+
+    bool load(); //false if file has no valid index
+    void reset(); //empty index, not logged
+    void setValid(bool valid); //not logged
+
+    bool find(const Key &k, unsigned long long *place);
+    void put(const Key &k, unsigned long long place, Logger *logger); //NULL logger for not logged change
+    void erase(const Key &k, Logger *logger);
+
+    bool commit();
+    bool pending(); //there are writes not committed
+    void discard(); //pending writes are dropped, load again after it
+    bool good();
+
+    const static unsigned char log_id = 2; //file id in log records
+
+ private:
+    HashIndex(const HashIndex &h);
+    void operator =(const HashIndex &h);
+
+    struct Bucket{
+        unsigned long long offset, depth, pattern; //pattern is lower depth bits of hashes in bucket
+        std::vector<Key> keys;
+        std::vector<unsigned long long> places;
+    };
+
+    void readPage(unsigned long long offset, char *buf);
+    void readBucket(unsigned long long offset, Bucket &b);
+    void writeBucket(Bucket &b, Logger *logger);
+    void writeHead(Logger *logger);
+    void setDir(const Bucket &b);
+    size_t search(Bucket &b, const Key &k);
+
+    const static unsigned long long magic = 0x3268736168656572ULL; //changed with hash of keys
+    const static size_t head = 3 * sizeof(unsigned long long); //magic, valid, number of buckets
+    const static size_t entry = sizeof(Key) + sizeof(unsigned long long);
+    const static size_t page = 4096;
+    const static size_t cap = (page - 3 * sizeof(unsigned long long)) / entry;
+    const static unsigned long long max_depth = 30;
+    static_assert(cap >= 2, "Key is too big for hash bucket");
+
+    WriteBack file;
+    Cacher cache;
+    bool valid;
+    unsigned long long buckets, global;
+    std::vector<unsigned long long> dir; //bucket offset by lower global bits of hash
+};
+
+template <typename Key>
+HashIndex<Key>::HashIndex(const char *name):file(name), cache(page), valid(false), buckets(0), global(0){}
+
+template <typename Key>
+bool HashIndex<Key>::load(){
+    unsigned long long h[3];
+    file.read(0, (char*)h, head);
+    if (h[0] != magic || h[1] == 0)
+        return false;
+    valid = true;
+    buckets = h[2];
+    global = 0;
+    std::vector<unsigned long long> depths(buckets), patterns(buckets);
+    for (unsigned long long i = 0; i < buckets; i++){
+        unsigned long long bh[2];
+        file.read(head + i * page, (char*)bh, sizeof(bh));
+        depths[i] = bh[0];
+        patterns[i] = bh[1];
+        global = std::max(global, depths[i]);
+    }
+    dir.assign(1ULL << global, 0);
+    for (unsigned long long i = 0; i < buckets; i++){
+        Bucket b;
+        b.offset = head + i * page;
+        b.depth = depths[i];
+        b.pattern = patterns[i];
+        setDir(b);
+    }
+    return file.good();
+}
+
+template <typename Key>
+void HashIndex<Key>::reset(){
+    buckets = 1;
+    global = 0;
+    dir.assign(1, head);
+    Bucket b;
+    b.offset = head;
+    b.depth = b.pattern = 0;
+    writeBucket(b, NULL);
+    writeHead(NULL);
+}
+
+template <typename Key>
+void HashIndex<Key>::setValid(bool v){
+    valid = v;
+    writeHead(NULL);
+}
+
+template <typename Key>
+bool HashIndex<Key>::find(const Key &k, unsigned long long *place){
+    Bucket b;
+    readBucket(dir[KeyHash<Key>::get(k) & (dir.size() - 1)], b);
+    size_t pos = search(b, k);
+    if (pos == b.keys.size())
+        return false;
+    *place = b.places[pos];
+    return true;
+}
+
+template <typename Key>
+void HashIndex<Key>::put(const Key &k, unsigned long long place, Logger *logger){
+    unsigned long long h = KeyHash<Key>::get(k);
+    while (true){
+        Bucket b;
+        readBucket(dir[h & (dir.size() - 1)], b);
+        size_t pos = search(b, k);
+        if (pos != b.keys.size()){
+            b.places[pos] = place;
+            writeBucket(b, logger);
+            return;
+        }
+        if (b.keys.size() < cap){
+            b.keys.emplace_back(k);
+            b.places.emplace_back(place);
+            writeBucket(b, logger);
+            return;
+        }
+
+        //split by next bit of hash and try again
+        if (b.depth == max_depth)
+            throw std::runtime_error("Too many hash collisions");
+        if (b.depth == global){
+            dir.insert(dir.end(), dir.begin(), dir.end());
+            global++;
+        }
+        Bucket nb;
+        nb.offset = head + buckets * page;
+        buckets++;
+        nb.depth = ++b.depth;
+        nb.pattern = b.pattern | (1ULL << (b.depth - 1));
+        size_t kept = 0;
+        for (size_t i = 0; i < b.keys.size(); i++){
+            if (KeyHash<Key>::get(b.keys[i]) & (1ULL << (b.depth - 1))){
+                nb.keys.emplace_back(b.keys[i]);
+                nb.places.emplace_back(b.places[i]);
+            }else{
+                b.keys[kept] = b.keys[i];
+                b.places[kept] = b.places[i];
+                kept++;
+            }
+        }
+        b.keys.resize(kept);
+        b.places.resize(kept);
+        writeBucket(b, logger);
+        writeBucket(nb, logger);
+        writeHead(logger);
+        setDir(nb);
+    }
+}
+
+template <typename Key>
+void HashIndex<Key>::erase(const Key &k, Logger *logger){
+    Bucket b;
+    readBucket(dir[KeyHash<Key>::get(k) & (dir.size() - 1)], b);
+    size_t pos = search(b, k);
+    if (pos == b.keys.size())
+        return;
+    b.keys[pos] = b.keys.back();
+    b.places[pos] = b.places.back();
+    b.keys.pop_back();
+    b.places.pop_back();
+    writeBucket(b, logger);
+}
+
+template <typename Key>
+bool HashIndex<Key>::commit(){
+    return file.commit();
+}
+
+template <typename Key>
+bool HashIndex<Key>::pending(){
+    return file.pending();
+}
+
+template <typename Key>
+void HashIndex<Key>::discard(){
+    file.discard();
+    cache.clear();
+}
+
+template <typename Key>
+bool HashIndex<Key>::good(){
+    return file.good();
+}
+
+template <typename Key>
+void HashIndex<Key>::readPage(unsigned long long offset, char *buf){
+    char *res = cache.get(offset);
+    if (res != NULL){
+        memcpy(buf, res, page);
+        return;
+    }
+    file.read(offset, buf, page);
+    cache.update(offset, buf, page);
+}
+
+template <typename Key>
+void HashIndex<Key>::readBucket(unsigned long long offset, Bucket &b){
+    char buf[page];
+    readPage(offset, buf);
+    unsigned long long h[3];
+    memcpy(h, buf, sizeof(h));
+    b.offset = offset;
+    b.depth = h[0];
+    b.pattern = h[1];
+    b.keys.resize(h[2]);
+    b.places.resize(h[2]);
+    size_t pos = sizeof(h);
+    for (size_t i = 0; i < h[2]; i++, pos += entry){
+        memcpy((char*)&b.keys[i], buf + pos, sizeof(Key));
+        memcpy(&b.places[i], buf + pos + sizeof(Key), sizeof(unsigned long long));
+    }
+}
+
+template <typename Key>
+void HashIndex<Key>::writeBucket(Bucket &b, Logger *logger){
+    char buf[page];
+    if (logger != NULL){
+        readPage(b.offset, buf);
+        logger -> log(b.offset, buf, page, log_id);
+    }
+    memset(buf, 0, page);
+    unsigned long long h[3] = {b.depth, b.pattern, b.keys.size()};
+    memcpy(buf, h, sizeof(h));
+    size_t pos = sizeof(h);
+    for (size_t i = 0; i < b.keys.size(); i++, pos += entry){
+        memcpy(buf + pos, (const char*)&b.keys[i], sizeof(Key));
+        memcpy(buf + pos + sizeof(Key), &b.places[i], sizeof(unsigned long long));
+    }
+    cache.update(b.offset, buf, page);
+    file.write(b.offset, buf, page);
+}
+
+template <typename Key>
+void HashIndex<Key>::writeHead(Logger *logger){
+    unsigned long long h[3] = {magic, valid, buckets};
+    if (logger != NULL){
+        unsigned long long old[3];
+        file.read(0, (char*)old, head);
+        logger -> log(0, (char*)old, head, log_id);
+    }
+    file.write(0, (char*)h, head);
+}
+
+template <typename Key>
+void HashIndex<Key>::setDir(const Bucket &b){
+    for (unsigned long long i = b.pattern; i < dir.size(); i += (1ULL << b.depth))
+        dir[i] = b.offset;
+}
+
+template <typename Key>
+size_t HashIndex<Key>::search(Bucket &b, const Key &k){
+    for (size_t i = 0; i < b.keys.size(); i++)
+        if (b.keys[i] == k)
+            return i;
+    return b.keys.size();
+}
+
+#endif
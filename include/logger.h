@@ -2,17 +2,25 @@
 #define LOGGER_H_
 
 #include <fstream>
+#include <vector>
 
+//undo log: records of operation are kept in memory and written with one write before its pages
 class Logger{
  public:
-    Logger();
-    void log(unsigned long long, char*, size_t, bool is_value);
+    Logger(const char *name = "btree.log");
+    void log(unsigned long long, char*, size_t, unsigned char file_id); //0 for nodes, 1 for values, 2 for hash index
+    void flush(); //writes kept records, before pages they undo are written
     void finish();
     void init();
-    void recoverTree(std::fstream &f, std::fstream &f_vals);
+    void begin(); //init and finish do nothing until end, so following operations are undone together
+    void end();
+    bool inTransaction();
+    void recoverTree(std::fstream &f, std::fstream &f_vals, std::fstream *f_hash = NULL);
 
  private:
-    size_t num, pos;
+    size_t num, pos; //records of operation, end of written ones in file
+    bool tx;
+    std::vector<char> kept; //records not written yet, after space for count
     std::fstream file;
 };
 
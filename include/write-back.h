@@ -0,0 +1,32 @@
+#ifndef WRITE_BACK_H_
+#define WRITE_BACK_H_
+
+#include <map>
+#include <vector>
+
+//file with positional reads and writes; writes are kept in memory until commit, then written ordered
+//by offset with adjacent ranges coalesced into one pwritev
+class WriteBack{
+ public:
+    WriteBack(const char *name); //file is created if missing
+    ~WriteBack();
+    void read(unsigned long long offset, char *buf, size_t len); //sees pending writes, zeros past end of file
+    void write(unsigned long long offset, const char *buf, size_t len);
+    unsigned long long end(); //size of file with pending writes
+    bool commit();
+    bool pending(); //there are writes not committed
+    void discard(); //pending writes are dropped
+    bool good();
+
+    unsigned long long syscalls; //number of pwritev done
+
+ private:
+    WriteBack(const WriteBack &w);
+    void operator =(const WriteBack &w);
+
+    int fd;
+    bool ok;
+    std::map<unsigned long long, std::vector<char> > dirty; //not overlapping ranges by start
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include <fstream>
+#include "bloom.h"
+
+unsigned long long hashBytes(const char *data, size_t sz){
+    unsigned long long h = 14695981039346656037ULL; //FNV-1a
+    for (size_t i = 0; i < sz; i++){
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33; //final mixing, low bits of FNV are weak
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+Bloom::Bloom():elems(0), dels(0), capacity(0), dirty(false){}
+
+void Bloom::reset(size_t expected){
+    if (expected == 0)
+        expected = 1;
+    capacity = expected;
+    bits.assign((expected * bits_per_key + 63) / 64, 0);
+    elems = dels = 0;
+}
+
+void Bloom::add(unsigned long long h){
+    unsigned long long step = (h >> 32) | 1, total = bits.size() * 64;
+    for (size_t i = 0; i < num_hashes; i++){
+        unsigned long long b = (h + i * step) % total;
+        bits[b / 64] |= 1ULL << (b % 64);
+    }
+}
+
+bool Bloom::mayContain(unsigned long long h){
+    unsigned long long step = (h >> 32) | 1, total = bits.size() * 64;
+    for (size_t i = 0; i < num_hashes; i++){
+        unsigned long long b = (h + i * step) % total;
+        if (!(bits[b / 64] & (1ULL << (b % 64))))
+            return false;
+    }
+    return true;
+}
+
+//file: magic, dirty flag, stamp, capacity, elems, dels, number of words, words
+bool Bloom::load(const char *name, unsigned long long stamp){
+    std::ifstream f(name, std::ios::in | std::ios::binary);
+    if (!f.good())
+        return false;
+    char d = 1;
+    unsigned long long mg = 0, st = 0, cap = 0, words = 0;
+    f.read((char*)&mg, sizeof(unsigned long long));
+    f.read(&d, 1);
+    f.read((char*)&st, sizeof(unsigned long long));
+    f.read((char*)&cap, sizeof(unsigned long long));
+    f.read((char*)&elems, sizeof(unsigned long long));
+    f.read((char*)&dels, sizeof(unsigned long long));
+    f.read((char*)&words, sizeof(unsigned long long));
+    if (!f.good() || mg != magic || d != 0 || st != stamp || words == 0)
+        return false;
+    bits.assign(words, 0);
+    f.read((char*)&bits[0], words * sizeof(unsigned long long));
+    if (!f.good())
+        return false;
+    capacity = cap;
+    dirty = false;
+    return true;
+}
+
+bool Bloom::save(const char *name, unsigned long long stamp){
+    std::ofstream f(name, std::ios::out | std::ios::binary | std::ios::trunc);
+    char d = 0;
+    unsigned long long mg = magic, cap = capacity, words = bits.size();
+    f.write((char*)&mg, sizeof(unsigned long long));
+    f.write(&d, 1);
+    f.write((char*)&stamp, sizeof(unsigned long long));
+    f.write((char*)&cap, sizeof(unsigned long long));
+    f.write((char*)&elems, sizeof(unsigned long long));
+    f.write((char*)&dels, sizeof(unsigned long long));
+    f.write((char*)&words, sizeof(unsigned long long));
+    f.write((char*)&bits[0], words * sizeof(unsigned long long));
+    f.flush();
+    if (!f.good())
+        return false;
+    dirty = false;
+    return true;
+}
+
+//filter in file is stale from the first change until next save, so it mustn't be trusted after a crash
+bool Bloom::markDirty(const char *name){
+    if (dirty)
+        return true;
+    std::fstream f(name, std::ios::in | std::ios::out | std::ios::binary);
+    char d = 1;
+    f.seekp(sizeof(unsigned long long));
+    f.write(&d, 1);
+    f.flush();
+    if (!f.good())
+        return false;
+    dirty = true;
+    return true;
+}
@@ -3,36 +3,75 @@
 
 using namespace std;
 
-Cacher::Cacher(size_t sz):sz(sz){}
+Cacher::Cacher(size_t sz, size_t max_size):hits(0), misses(0), sz(sz), used(0), max_size(max_size){}
 
 Cacher::~Cacher(){
     while (!store.empty()){
-        delete [] store.begin() -> second;
+        delete [] store.begin() -> second.bin;
         store.erase(store.begin());
     }
 }
 
 void Cacher::update(unsigned long long offset, char* bin){
-    char *buf = new char[sz];
-    memcpy(buf, bin, sz);
-    if (store.count(offset) != 0){
-        delete []store[offset];
-    }
+    update(offset, bin, sz);
+}
 
-    store[offset] = buf;
-    if (store.size() * sz > max_size){
-        std::map<unsigned long long, char*>::iterator it = store.upper_bound(offset);
-        if (it == store.end())
-            it = store.find(store.rbegin() -> first);
-        delete [] it -> second;
-        store.erase(it);
+void Cacher::update(unsigned long long offset, char* bin, size_t len){
+    if (max_size < len)
+        return;
+    map<unsigned long long, Entry>::iterator it = store.find(offset);
+    if (it != store.end() && it -> second.len == len){
+        memcpy(it -> second.bin, bin, len);
+        order.splice(order.begin(), order, it -> second.pos);
+        return;
     }
-}
+    if (it != store.end())
+        erase(offset);
 
+    Entry e;
+    e.bin = new char[len];
+    e.len = len;
+    memcpy(e.bin, bin, len);
+    order.push_front(offset);
+    e.pos = order.begin();
+    store[offset] = e;
+    used += len;
+    shrink();
+}
 
 char* Cacher::get(unsigned long long offset){
-    if (store.count(offset) != 0)
-        return store[offset];
-    else
+    map<unsigned long long, Entry>::iterator it = store.find(offset);
+    if (it == store.end()){
+        misses++;
         return NULL;
+    }
+    hits++;
+    order.splice(order.begin(), order, it -> second.pos);
+    return it -> second.bin;
+}
+
+void Cacher::erase(unsigned long long offset){
+    map<unsigned long long, Entry>::iterator it = store.find(offset);
+    if (it == store.end())
+        return;
+    order.erase(it -> second.pos);
+    used -= it -> second.len;
+    delete [] it -> second.bin;
+    store.erase(it);
+}
+
+void Cacher::setMaxSize(size_t new_max){
+    max_size = new_max;
+    shrink();
+}
+
+void Cacher::clear(){
+    while (!store.empty())
+        erase(store.begin() -> first);
+}
+
+void Cacher::shrink(){
+    while (!store.empty() && used > max_size){
+        erase(order.back());
+    }
 }
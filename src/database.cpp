@@ -0,0 +1,255 @@
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <exception>
+#include <stdexcept>
+#include "database.h"
+
+using namespace std;
+
+Database::Database(const char *name):name(createFiles(name)), logger((this -> name + ".log").c_str()),
+        file((this -> name + ".main").c_str()), file_vals((this -> name + ".vals").c_str()), cache(0), vals_cache(0, 1<<22){
+    {
+        fstream f((this -> name + ".main").c_str(), ios::in | ios::out | ios::binary);
+        fstream f_vals((this -> name + ".vals").c_str(), ios::in | ios::out | ios::binary);
+        logger.recoverTree(f, f_vals);
+    }
+    open();
+}
+
+Database::Database(const char *main, const char *vals, const char *log, const char *hash):logger(log),
+        file(main), file_vals(vals), cache(0), vals_cache(0, 1<<22){
+    {
+        fstream f(main, ios::in | ios::out | ios::binary);
+        fstream f_vals(vals, ios::in | ios::out | ios::binary);
+        fstream f_hash;
+        if (hash != NULL)
+            f_hash.open(hash, ios::in | ios::out | ios::binary);
+        logger.recoverTree(f, f_vals, f_hash.is_open() ? &f_hash : NULL);
+    }
+    open();
+}
+
+void Database::open(){
+    unsigned long long head[3] = {magic, version, 0};
+    if (file.end() == 0){
+        char buf[catalog_size];
+        memset(buf, 0, catalog_size);
+        memcpy(buf, head, sizeof(head));
+        file.write(0, buf, catalog_size);
+    }else{
+        file.read(0, (char*)head, sizeof(head));
+        if (head[0] != magic)
+            throw runtime_error("Wrong format of main file");
+        if (head[1] != version)
+            throw runtime_error("Unsupported version of main file");
+    }
+    if (file_vals.end() < sizeof(unsigned long long)){ //offset 0 means no free place
+        unsigned long long zero = 0;
+        file_vals.write(0, (char*)&zero, sizeof(unsigned long long));
+    }
+    if (!writeBack())
+        throw runtime_error("Error on opening database");
+}
+
+string Database::createFiles(const char *name){
+    string res(name);
+    ofstream a((res + ".main").c_str(), ios::out | ios::app), b((res + ".vals").c_str(), ios::out | ios::app);
+    ofstream c((res + ".log").c_str(), ios::out | ios::app);
+    return res;
+}
+
+void Database::begin(){
+    if (logger.inTransaction())
+        throw runtime_error("Transaction is already started");
+    for (size_t i = 0; i < trees.size(); i++)
+        trees[i] -> beforeBegin();
+    logger.begin();
+}
+
+void Database::commit(){
+    if (!logger.inTransaction())
+        return;
+    if (!commitFiles())
+        throw runtime_error("Error with file while commit");
+    logger.end();
+}
+
+//nothing of transaction is in files yet, so pending writes and cached pages are dropped
+void Database::abort(){
+    if (!logger.inTransaction())
+        return;
+    file.discard();
+    file_vals.discard();
+    cache.clear();
+    vals_cache.clear();
+    logger.end();
+    for (size_t i = 0; i < trees.size(); i++)
+        trees[i] -> abort();
+}
+
+void Database::setCacheSize(size_t bytes){
+    cache.setMaxSize(bytes);
+}
+
+void Database::setValueCacheSize(size_t bytes){
+    vals_cache.setMaxSize(bytes);
+}
+
+unsigned long long Database::openTree(const char *tree, size_t node_size, size_t value_size){
+    if (strlen(tree) >= name_size)
+        throw runtime_error("Too long name of tree");
+    unsigned long long cnt;
+    file.read(2 * sizeof(unsigned long long), (char*)&cnt, sizeof(unsigned long long));
+    unsigned long long pos = catalog_head;
+    for (unsigned long long i = 0; i < cnt; i++, pos += entry_size){
+        char entry[entry_size];
+        file.read(pos, entry, entry_size);
+        if (strncmp(entry, tree, name_size) != 0)
+            continue;
+        unsigned long long sizes[2];
+        memcpy(sizes, entry + name_size + 3 * sizeof(unsigned long long), sizeof(sizes));
+        if (sizes[0] != node_size || sizes[1] != value_size)
+            throw runtime_error("Tree is stored with other types");
+        return pos + name_size;
+    }
+    if (pos + entry_size > catalog_size)
+        throw runtime_error("Too many trees in database");
+    if (logger.inTransaction()) //abort would leave opened tree without catalog entry
+        throw runtime_error("Tree can't be created inside transaction");
+
+    logger.init();
+    char old[catalog_size];
+    file.read(0, old, catalog_size);
+    logger.log(0, old, catalog_size, 0);
+
+    char entry[entry_size];
+    memset(entry, 0, entry_size);
+    strcpy(entry, tree);
+    //root, free list head, place of free list head in values file, sizes, generation
+    unsigned long long fields[6] = {file.end(), 0, file_vals.end(), node_size, value_size, 0};
+    memcpy(entry + name_size, fields, sizeof(fields));
+    std::vector<char> root(node_size, 0);
+    file.write(fields[0], &root[0], node_size);
+    file_vals.write(fields[2], &root[0], sizeof(unsigned long long));
+    file.write(pos, entry, entry_size);
+    cnt++;
+    file.write(2 * sizeof(unsigned long long), (char*)&cnt, sizeof(unsigned long long));
+    if (!writeBack())
+        throw runtime_error("Error with file while opening tree");
+    logger.finish();
+    return pos + name_size;
+}
+
+bool Database::writeBack(){
+    if (logger.inTransaction())
+        return file.good() && file_vals.good();
+    return commitFiles();
+}
+
+bool Database::commitFiles(){
+    logger.flush(); //undo records go before pages
+    bool ok = file.commit();
+    ok = file_vals.commit() && ok;
+    for (size_t i = 0; i < trees.size(); i++)
+        ok = trees[i] -> commitFiles() && ok;
+    return ok;
+}
+
+TreeBase::TreeBase(Database *own, const char *name, size_t node_size, size_t value_size):own(own), db(*own), logger(db.logger),
+        file(db.file), file_vals(db.file_vals), cache(db.cache), vals_cache(db.vals_cache), touched(false), bumped(false){
+    try{
+        open(name, node_size, value_size);
+    }catch (...){
+        delete own;
+        throw;
+    }
+    db.trees.push_back(this);
+}
+
+TreeBase::TreeBase(Database &db, const char *name, size_t node_size, size_t value_size):own(NULL), db(db), logger(db.logger),
+        file(db.file), file_vals(db.file_vals), cache(db.cache), vals_cache(db.vals_cache), touched(false), bumped(false){
+    open(name, node_size, value_size);
+    db.trees.push_back(this);
+}
+
+TreeBase::~TreeBase(){
+    db.trees.erase(find(db.trees.begin(), db.trees.end(), this));
+    delete own;
+}
+
+bool TreeBase::commitFiles(){
+    return true;
+}
+
+void TreeBase::beforeBegin(){}
+
+void TreeBase::abort(){
+    readState();
+}
+
+void TreeBase::open(const char *name, size_t node_size, size_t value_size){
+    unsigned long long entry = db.openTree(name, node_size, value_size);
+    head_main = entry + sizeof(unsigned long long);
+    file.read(entry + 2 * sizeof(unsigned long long), (char*)&head_vals, sizeof(unsigned long long));
+    head_gen = entry + 5 * sizeof(unsigned long long);
+    readState();
+}
+
+void TreeBase::readState(){ //root is just before head of free list in catalog entry
+    file.read(head_main - sizeof(unsigned long long), (char*)&root, sizeof(unsigned long long));
+    file.read(head_main, (char*)&nxt_space, sizeof(unsigned long long));
+    file_vals.read(head_vals, (char*)&nxt_space_vals, sizeof(unsigned long long));
+    file.read(head_gen, (char*)&generation, sizeof(unsigned long long));
+    touched = bumped = false; //copies may be stamped with generation on disk
+    if (!file.good() || !file_vals.good())
+        throw runtime_error("Error on opening tree");
+}
+
+unsigned long long TreeBase::allocate(bool is_value){
+    WriteBack &f = (is_value ? file_vals : file);
+    unsigned long long &next = (is_value ? nxt_space_vals : nxt_space), head = (is_value ? head_vals : head_main);
+    if (next == 0)
+        return f.end();
+    unsigned long long res = next, link;
+    f.read(res, (char*)&link, sizeof(unsigned long long));
+    logger.log(head, (char*)&res, sizeof(unsigned long long), is_value);
+    f.write(head, (char*)&link, sizeof(unsigned long long));
+    next = link;
+    return res;
+}
+
+//freed place keeps link to next free one
+void TreeBase::release(unsigned long long offset, const char *old, size_t size, bool is_value){
+    WriteBack &f = (is_value ? file_vals : file);
+    unsigned long long &next = (is_value ? nxt_space_vals : nxt_space), head = (is_value ? head_vals : head_main);
+    vector<char> buf(size, 0);
+    memcpy(&buf[0], &next, sizeof(unsigned long long));
+    logger.log(offset, (char*)old, size, is_value);
+    f.write(offset, &buf[0], size);
+    if (is_value)
+        vals_cache.erase(offset);
+    else
+        cache.update(offset, &buf[0], size);
+
+    logger.log(head, (char*)&next, sizeof(unsigned long long), is_value);
+    f.write(head, (char*)&offset, sizeof(unsigned long long));
+    next = offset;
+}
+
+bool TreeBase::writeBack(){ //after undo records of operation are in log
+    if (touched && !bumped){ //copies stamped with older generation, like saved filter, are stale now
+        logger.log(head_gen, (char*)&generation, sizeof(unsigned long long), 0);
+        generation++;
+        file.write(head_gen, (char*)&generation, sizeof(unsigned long long));
+        bumped = true;
+    }
+    touched = false;
+    return db.writeBack();
+}
+
+unsigned long long TreeBase::stamp(){
+    bumped = false;
+    return generation;
+}
@@ -1,8 +1,11 @@
 #include <exception>
+#include <stdexcept>
+#include <cstring>
+#include <vector>
 #include "logger.h"
 
-Logger::Logger(){
-    file.open("btree.log", std::ios::in | std::ios::out | std::ios::binary);
+Logger::Logger(const char *name):num(0), pos(0), tx(false), kept(sizeof(unsigned long long), 0){
+    file.open(name, std::ios::in | std::ios::out | std::ios::binary);
     if (!file.good()){
         file.close();
         throw std::runtime_error("Error in file for logger");
@@ -10,71 +13,121 @@ Logger::Logger(){
 }
 
 void Logger::init(){
-    pos = 1;
+    if (tx)
+        return;
+    pos = 0; //nothing is written
     num = 0;
-    file.seekp(0, std::ios_base::beg);
-    char c = 0;
-    file.write(&c, 1);
-    file.flush();
+    kept.assign(sizeof(unsigned long long), 0);
 }
 
-void Logger::log(unsigned long long offset, char* bin, size_t sz, bool is_value){
-    file.seekp(pos, std::ios_base::beg);
-    file.write((char*)&is_value, 1);
-    pos++;
-    file.write((char*)&offset, sizeof(unsigned long long));
-    pos += sizeof(unsigned long long);
-    file.write((char*)&sz, sizeof(size_t));
-    pos += sizeof(size_t);
-    file.write(bin, sz);
-    pos += sz;
-
+void Logger::log(unsigned long long offset, char* bin, size_t sz, unsigned char file_id){
+    size_t at = kept.size();
+    kept.resize(at + 1 + sizeof(unsigned long long) + sizeof(size_t) + sz);
+    kept[at] = file_id;
+    memcpy(&kept[at + 1], &offset, sizeof(unsigned long long));
+    memcpy(&kept[at + 1 + sizeof(unsigned long long)], &sz, sizeof(size_t));
+    memcpy(&kept[at + 1 + sizeof(unsigned long long) + sizeof(size_t)], bin, sz);
     num++;
-    file.seekp(0, std::ios_base::beg);
-    file.write((char*)&num, 1);
-    file.flush();
+}
 
+//count goes with records if they start the log, otherwise it is written after them
+void Logger::flush(){
+    if (kept.size() == sizeof(unsigned long long))
+        return;
+    memcpy(&kept[0], &num, sizeof(unsigned long long));
+    if (pos == 0){
+        file.seekp(0, std::ios_base::beg);
+        file.write(&kept[0], kept.size());
+        pos = kept.size();
+    }else{
+        file.seekp(pos, std::ios_base::beg);
+        file.write(&kept[sizeof(unsigned long long)], kept.size() - sizeof(unsigned long long));
+        pos += kept.size() - sizeof(unsigned long long);
+        file.seekp(0, std::ios_base::beg);
+        file.write(&kept[0], sizeof(unsigned long long));
+    }
+    file.flush();
+    kept.resize(sizeof(unsigned long long));
     if (!file.good())
         throw std::runtime_error("Error in file for logger");
 }
 
 void Logger::finish(){
+    if (tx)
+        return;
+    kept.assign(sizeof(unsigned long long), 0);
+    num = 0;
+    if (pos == 0) //log is empty already
+        return;
     pos = 0;
     file.seekp(0, std::ios_base::beg);
-    char c = 0;
-    file.write(&c, 1);
+    file.write((char*)&num, sizeof(unsigned long long));
     file.flush();
     if (!file.good())
         throw std::runtime_error("Error in file for logger");
+}
+
+void Logger::begin(){
+    init();
+    tx = true;
+}
 
+void Logger::end(){
+    tx = false;
+    finish();
 }
 
-void Logger::recoverTree(std::fstream &f, std::fstream &f_vals){
+bool Logger::inTransaction(){
+    return tx;
+}
+
+void Logger::recoverTree(std::fstream &f, std::fstream &f_vals, std::fstream *f_hash){
     file.seekg(0, std::ios_base::end);
-    if (file.tellg() == 0)
+    if (file.tellg() < (std::streamoff)sizeof(unsigned long long))
         return;
     file.seekg(0, std::ios_base::beg);
-    char cnt;
-    file.read(&cnt, 1);
-    while (cnt != 0){
+    unsigned long long cnt = 0;
+    file.read((char*)&cnt, sizeof(unsigned long long));
+    std::vector<std::streampos> records;
+    while (cnt != 0 && file.good()){
         cnt--;
-        bool is_value;
+        records.emplace_back(file.tellg());
+        file.seekg(1 + sizeof(unsigned long long), std::ios_base::cur);
+        size_t sz;
+        file.read((char*)&sz, sizeof(size_t));
+        file.seekg(sz, std::ios_base::cur);
+    }
+
+    //same place may be logged several times in one operation, the first image is the right one
+    for (size_t i = records.size(); i-- > 0;){
+        unsigned char file_id;
         unsigned long long offset;
         size_t sz;
-        file.read((char*)&is_value, 1);
+        file.seekg(records[i], std::ios_base::beg);
+        file.read((char*)&file_id, 1);
         file.read((char*)&offset, sizeof(unsigned long long));
         file.read((char*)&sz, sizeof(size_t));
-        char buf[sz];
-        file.read(buf, sz);
-        if (!is_value){
-            f.seekp(offset, std::ios_base::beg);
-            f.write(buf, sz);
-        }else{
-            f_vals.seekp(offset, std::ios_base::beg);
-            f_vals.write(buf, sz);
-        }
+        std::vector<char> buf(sz);
+        file.read(&buf[0], sz);
+        std::fstream *to = (file_id == 0 ? &f : file_id == 1 ? &f_vals : f_hash);
+        if (to == NULL)
+            throw std::runtime_error("Error on recovery");
+        to -> seekp(offset, std::ios_base::beg);
+        to -> write(&buf[0], sz);
     }
-    if (!file.good() || !f.good() || !f_vals.good())
+    if (!file.good() || !f.good() || !f_vals.good() || (f_hash != NULL && !f_hash -> good()))
+        throw std::runtime_error("Error on recovery");
+    if (records.empty())
+        return;
+    f.flush(); //log is cleared after undone pages are in files, init doesn't write it
+    f_vals.flush();
+    if (f_hash != NULL)
+        f_hash -> flush();
+    cnt = 0;
+    file.seekp(0, std::ios_base::beg);
+    file.write((char*)&cnt, sizeof(unsigned long long));
+    file.flush();
+    if (!file.good() || !f.good() || !f_vals.good() || (f_hash != NULL && !f_hash -> good()))
         throw std::runtime_error("Error on recovery");
 }
 
@@ -1,8 +1,10 @@
 #include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <cassert>
 #include <map>
+#include <array>
 
 using namespace std;
 
@@ -12,6 +14,7 @@ int num = 0, failed = 0;
 #define SUCCESS num++;
 
 #include "b-tree.h"
+#include "be-tree.h"
 
 void print(const char *func, size_t lineNum){
     cout << "Test failed " << func << " in line " << lineNum << endl;
@@ -21,6 +24,18 @@ void clear_tree(){
     fstream file("btree.main", std::fstream::out | ios_base::trunc);
     fstream l("btree.log", std::fstream::out | ios_base::trunc);
     fstream file_vals("btree.vals", std::fstream::out | ios_base::trunc);
+    fstream bloom("btree.bloom", std::fstream::out | ios_base::trunc);
+    fstream wal("btree.wal", std::fstream::out | ios_base::trunc);
+    fstream hash("btree.hash", std::fstream::out | ios_base::trunc);
+    hash.close();
+    fstream be("betree.main", std::fstream::out | ios_base::trunc);
+    fstream be_vals("betree.vals", std::fstream::out | ios_base::trunc);
+    fstream be_log("betree.log", std::fstream::out | ios_base::trunc);
+    be_log.close();
+    be_vals.close();
+    be.close();
+    wal.close();
+    bloom.close();
     file_vals.close();
     l.close();
     file.close();
@@ -206,6 +221,1063 @@ void test_reuse(){
     SUCCESS;
 }
 
+void test_filter(){
+    clear_tree();
+    map<int, int> mp;
+    bool bad = false;
+    {
+        Btree<int, int, 20> b;
+        b.enableFilter(100);
+        for (size_t i = 0; i < 2000; i++){
+            int a = rand() % 4000;
+            mp[a] = i;
+            b.addElem(a, i);
+        }
+        for (size_t i = 0; i < 1000; i++){
+            int a = rand() % 4000;
+            mp.erase(a);
+            b.delElem(a);
+        }
+    }
+    int vv;
+    int *v = &vv;
+    {
+        Btree<int, int, 20> b; //filter is loaded from btree.bloom
+        b.enableFilter();
+        for (int i = 0; i < 4000; i++){
+            bool res = b.findElem(i, v);
+            if (res != (mp.count(i) != 0) || (res && mp[i] != *v))
+                bad = true;
+        }
+    }
+    {
+        Btree<int, int, 20> b; //change without filter, size of file stays the same
+        int fresh = 0;
+        while (mp.count(fresh))
+            fresh++;
+        b.addElem(fresh, 1);
+        mp[fresh] = 1;
+    }
+    {
+        Btree<int, int, 20> b; //filter saved in the middle of session is stale after next change
+        b.enableFilter();
+        b.addElem(5000, 1);
+        b.rebuildFilter();
+        ifstream saved("btree.bloom", ios::in | ios::binary);
+        ofstream copy("btree.bloom.tmp", ios::out | ios::binary | ios::trunc);
+        copy << saved.rdbuf();
+        b.addElem(5001, 1);
+        mp[5000] = mp[5001] = 1;
+    }
+    rename("btree.bloom.tmp", "btree.bloom"); //as if closed without saving filter
+    Btree<int, int, 20> b; //saved filter is stale now
+    b.enableFilter();
+    for (int i = 0; i < 5010; i++){
+        bool res = b.findElem(i, v);
+        if (res != (mp.count(i) != 0) || (res && mp[i] != *v))
+            bad = true;
+    }
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_read_modify_write(){
+    clear_tree();
+    Btree<int, long long, 20> b;
+    map<int, long long> mp;
+    bool bad = false;
+    for (size_t i = 0; i < 3000; i++){
+        int a = rand() % 500;
+        b.upsert(a, [](long long &v, bool exists){ v = (exists ? v + 1 : 1); });
+        mp[a]++;
+    }
+    for (int i = 0; i < 500; i++)
+        if (b.updateElem(i, [](long long &v){ v *= 2; }) != (mp.count(i) != 0))
+            bad = true;
+        else if (mp.count(i))
+            mp[i] *= 2;
+
+    long long vv;
+    for (int i = 0; i < 600; i++){
+        bool inserted = b.insertIfAbsent(i, -1, &vv);
+        if (inserted != (mp.count(i) == 0) || (!inserted && vv != mp[i]))
+            bad = true;
+        if (inserted)
+            mp[i] = -1;
+    }
+    for (int i = 0; i < 700; i += 3){
+        bool res = b.take(i, &vv);
+        if (res != (mp.count(i) != 0) || (res && vv != mp[i]))
+            bad = true;
+        mp.erase(i);
+    }
+    for (int i = 0; i < 700; i++){
+        bool res = b.findElem(i, &vv);
+        if (res != (mp.count(i) != 0) || (res && vv != mp[i]))
+            bad = true;
+    }
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+template <typename Agg>
+unsigned long long check_counts(map<int, long long> &mp, bool &bad){ //returns size of btree.main
+    clear_tree();
+    {
+        Btree<int, long long, 3, Agg> b;
+        for (map<int, long long>::iterator it = mp.begin(); it != mp.end(); it++)
+            b.addElem(it -> first, it -> second);
+        if (b.size() != mp.size() || b.count(mp.begin() -> first, mp.rbegin() -> first) != mp.size())
+            bad = true;
+        int k;
+        long long v;
+        size_t i = 0;
+        for (map<int, long long>::iterator it = mp.begin(); it != mp.end(); it++, i++)
+            if (b.rank(it -> first) != i || !b.select(i, &k, &v) || k != it -> first || v != it -> second)
+                bad = true;
+    }
+    ifstream f("btree.main", ios::in | ios::binary | ios::ate);
+    return f.tellg();
+}
+
+void test_order_statistics(){
+    clear_tree();
+    Btree<int, long long, 3, SumAggregate<long long> > b;
+    map<int, long long> mp;
+    for (size_t i = 0; i < 2000; i++){
+        int a = rand() % 1500;
+        mp[a] = rand() % 1000;
+        b.addElem(a, mp[a]);
+    }
+    for (size_t i = 0; i < 700; i++){
+        int a = rand() % 1500;
+        mp.erase(a);
+        b.delElem(a);
+    }
+    b.updateElem(mp.begin() -> first, [](long long &v){ v += 5; });
+    mp.begin() -> second += 5;
+
+    bool bad = (b.size() != mp.size());
+    for (size_t i = 0; i < 300; i++){
+        int l = rand() % 1600 - 50, r = l + rand() % 400;
+        unsigned long long num = 0;
+        long long sum = 0;
+        for (map<int, long long>::iterator it = mp.lower_bound(l); it != mp.end() && it -> first <= r; it++){
+            num++;
+            sum += it -> second;
+        }
+        if (b.count(l, r) != num || b.aggregate(l, r) != sum)
+            bad = true;
+        if (b.rank(l) != (unsigned long long)distance(mp.begin(), mp.lower_bound(l)))
+            bad = true;
+    }
+    int k;
+    long long vv;
+    size_t i = 0;
+    for (map<int, long long>::iterator it = mp.begin(); it != mp.end(); it++, i++)
+        if (!b.select(i, &k, &vv) || k != it -> first || vv != it -> second)
+            bad = true;
+    if (b.select(mp.size(), &k, &vv))
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_counts(){
+    map<int, long long> mp;
+    for (int i = 0; i < 2000; i++)
+        mp[rand() % 5000] = i;
+    bool bad = false;
+    //counts can be kept without aggregate, plain trees keep nodes without counts and answer by reading subtrees
+    if (check_counts<NoAggregate<long long> >(mp, bad) >= check_counts<CountAggregate<long long> >(mp, bad))
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_del_range(){
+    clear_tree();
+    Btree<int, int, 3> b;
+    map<int, int> mp;
+    bool bad = false;
+    for (size_t i = 0; i < 3000; i++){
+        int a = rand() % 5000;
+        mp[a] = i;
+        b.addElem(a, i);
+    }
+    for (size_t i = 0; i < 40; i++){
+        int l = rand() % 5200 - 100, r = l + rand() % (i % 4 == 0 ? 2000 : 100);
+        unsigned long long num = 0;
+        while (mp.lower_bound(l) != mp.end() && mp.lower_bound(l) -> first <= r){
+            mp.erase(mp.lower_bound(l));
+            num++;
+        }
+        if (b.delRange(l, r) != num || b.size() != mp.size())
+            bad = true;
+        int a = rand() % 5000;
+        mp[a] = i;
+        b.addElem(a, i);
+    }
+    int vv;
+    int *v = &vv;
+    for (int i = 0; i < 5000; i++){
+        bool res = b.findElem(i, v);
+        if (res != (mp.count(i) != 0) || (res && mp[i] != *v))
+            bad = true;
+    }
+    b.delRange(-1, 5000);
+    if (b.size() != 0 || b.findElem(mp.begin() -> first, v))
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_frozen(){
+    clear_tree();
+    map<pair<int, int>, long long> mp;
+    {
+        Btree<pair<int, int>, long long, 10> b;
+        for (size_t i = 0; i < 3000; i++){
+            pair<int, int> a(rand() % 100, rand() % 100);
+            mp[a] = rand();
+            b.addElem(a, mp[a]);
+        }
+        b.freeze("btree.frozen");
+    }
+    FrozenBtree<pair<int, int>, long long> f("btree.frozen");
+    bool bad = (f.size() != mp.size());
+    long long vv = 0;
+    for (int i = 0; i < 100; i++)
+        for (int j = 0; j < 100; j++){
+            bool res = f.findElem(make_pair(i, j), &vv);
+            if (res != (mp.count(make_pair(i, j)) != 0) || (res && vv != mp[make_pair(i, j)]))
+                bad = true;
+        }
+    for (size_t i = 0; i < 100; i++){
+        pair<int, int> l(rand() % 110 - 5, rand() % 100), r(l.first + rand() % 10, rand() % 100);
+        vector<pair<pair<int, int>, long long> > v;
+        f.getElems(l, r, v);
+        map<pair<int, int>, long long>::iterator it = mp.lower_bound(l);
+        for (size_t j = 0; j < v.size(); j++, it++)
+            if (it == mp.end() || v[j].first != it -> first || v[j].second != it -> second)
+                bad = true;
+        if (it != mp.end() && !(r < it -> first))
+            bad = true;
+    }
+
+    clear_tree(); //three keys in page, so several levels
+    map<int, int> big;
+    {
+        Btree<array<int, 300>, int, 3> b;
+        b.freeze("btree.frozen"); //empty tree
+        if (FrozenBtree<array<int, 300>, int>("btree.frozen").size() != 0)
+            bad = true;
+        for (int i = 0; i < 600; i++){
+            array<int, 300> a = {};
+            a[0] = rand() % 2000;
+            big[a[0]] = i;
+            b.addElem(a, i);
+        }
+        b.freeze("btree.frozen");
+    }
+    FrozenBtree<array<int, 300>, int> g("btree.frozen");
+    if (g.size() != big.size())
+        bad = true;
+    for (int i = -1; i <= 2000; i++){
+        array<int, 300> a = {};
+        a[0] = i;
+        int v;
+        bool res = g.findElem(a, &v);
+        if (res != (big.count(i) != 0) || (res && v != big[i]))
+            bad = true;
+    }
+    vector<pair<array<int, 300>, int> > got;
+    array<int, 300> l = {}, r = {};
+    l[0] = 500;
+    r[0] = 1500;
+    g.getElems(l, r, got);
+    if (got.size() != (size_t)distance(big.lower_bound(500), big.upper_bound(1500)))
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_write_buffer(){
+    clear_tree();
+    map<int, int> mp;
+    bool bad = false;
+    int vv;
+    int *v = &vv;
+    {
+        Btree<int, int, 10> b;
+        b.enableWriteBuffer(300);
+        b.enableFilter();
+        for (size_t i = 0; i < 5000; i++){
+            int a = rand() % 3000;
+            if (rand() % 4 == 0){
+                mp.erase(a);
+                b.delElem(a);
+            }else{
+                mp[a] = i;
+                b.addElem(a, i);
+            }
+            if (i % 50 == 0){
+                a = rand() % 3000;
+                bool res = b.findElem(a, v);
+                if (res != (mp.count(a) != 0) || (res && mp[a] != *v))
+                    bad = true;
+                vector<pair<int, int> > got;
+                b.getElems(a, a + 200, got);
+                size_t num = distance(mp.lower_bound(a), mp.upper_bound(a + 200));
+                if (got.size() != num)
+                    bad = true;
+                for (pair<int, int> &p:got)
+                    if (!mp.count(p.first) || mp[p.first] != p.second)
+                        bad = true;
+            }
+        }
+        if (b.size() != mp.size())
+            bad = true;
+        b.addElem(-1, -1);
+        mp[-1] = -1;
+    } //rest of buffer is flushed here
+    Btree<int, int, 10> b;
+    for (int i = -1; i < 3000; i++){
+        bool res = b.findElem(i, v);
+        if (res != (mp.count(i) != 0) || (res && mp[i] != *v))
+            bad = true;
+    }
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_be_tree(){
+    clear_tree();
+    map<int, long long> mp;
+    bool bad = false;
+    long long vv;
+    {
+        BeTree<int, long long, 6, 16> b;
+        for (size_t i = 0; i < 6000; i++){
+            int a = rand() % 4000;
+            if (rand() % 3 == 0){
+                mp.erase(a);
+                b.delElem(a);
+            }else{
+                mp[a] = rand();
+                b.addElem(a, mp[a]);
+            }
+            if (i % 100 == 0){
+                a = rand() % 4000;
+                vector<pair<int, long long> > got;
+                b.getElems(a, a + 300, got);
+                map<int, long long>::iterator it = mp.lower_bound(a);
+                for (size_t j = 0; j < got.size(); j++, it++)
+                    if (it == mp.end() || got[j].first != it -> first || got[j].second != it -> second)
+                        bad = true;
+                if (it != mp.end() && it -> first <= a + 300)
+                    bad = true;
+            }
+        }
+    }
+    BeTree<int, long long, 6, 16> b;
+    for (int i = 0; i < 4000; i++){
+        bool res = b.findElem(i, &vv);
+        if (res != (mp.count(i) != 0) || (res && mp[i] != vv))
+            bad = true;
+    }
+
+    //upserts add to value, also over pending puts, deletes and other upserts
+    for (size_t i = 0; i < 6000; i++){
+        int a = rand() % 4000;
+        if (rand() % 5 == 0){
+            mp.erase(a);
+            b.delElem(a);
+        }else{
+            mp[a] += i;
+            b.upsert(a, i);
+        }
+    }
+    vector<pair<int, long long> > got;
+    b.getElems(0, 4000, got);
+    if (got != vector<pair<int, long long> >(mp.begin(), mp.end()))
+        bad = true;
+    for (int i = 0; i < 4000; i++){
+        bool res = b.findElem(i, &vv);
+        if (res != (mp.count(i) != 0) || (res && mp[i] != vv))
+            bad = true;
+    }
+
+    //nodes emptied by deletes are joined and reused by as many new keys
+    int n = mp.size();
+    for (map<int, long long>::iterator it = mp.begin(); it != mp.end(); it++)
+        b.delElem(it -> first);
+    ifstream f("betree.main", ios_base::ate | ios_base::binary);
+    long long before = f.tellg();
+    f.close();
+    for (int i = 4000; i < 4000 + n; i++)
+        b.addElem(i, i);
+    f.open("betree.main", ios_base::ate | ios_base::binary);
+    if ((long long)f.tellg() > before + before / 2) //new file would be of size of before
+        bad = true;
+    got.clear();
+    b.getElems(0, 8000, got);
+    if ((int)got.size() != n || got[0].first != 4000 || got.back().second != 3999 + n)
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_value_cache(){
+    clear_tree();
+    Btree<int, int, 3> b;
+    map<int, int> mp;
+    b.setValueCacheSize(64 * sizeof(unsigned long long));
+    bool bad = false;
+    for (int i = 0; i < 2000; i++){
+        int a = rand() % 500;
+        if (rand() % 4 == 0){
+            mp.erase(a);
+            b.delElem(a);
+        }else{
+            mp[a] = rand();
+            b.addElem(a, mp[a]);
+        }
+    }
+    int v;
+    unsigned long long hits, misses, h, m;
+    b.valueCacheStats(&hits, &misses);
+    for (int i = 0; i < 500; i++){
+        bool res = b.findElem(i, &v);
+        if (res != (mp.count(i) != 0) || (res && mp[i] != v))
+            bad = true;
+    }
+    //hot set fits in cache
+    for (int i = 0; i < 1000; i++)
+        if (b.findElem(mp.begin() -> first, &v) && v != mp.begin() -> second)
+            bad = true;
+    b.valueCacheStats(&h, &m);
+    if (h - hits < 999)
+        bad = true;
+    b.setValueCacheSize(0);
+    b.addElem(mp.begin() -> first, 7);
+    if (!b.findElem(mp.begin() -> first, &v) || v != 7)
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_lazy_delete(){
+    clear_tree();
+    Btree<int, int, 4> b;
+    map<int, int> mp;
+    bool bad = false;
+    for (int i = 0; i < 3000; i++){
+        int a = rand() % 4000;
+        mp[a] = i;
+        b.addElem(a, i);
+    }
+    b.enableLazyDelete();
+    int v;
+    for (int i = 0; i < 2500; i++){
+        int a = rand() % 4000;
+        if (b.take(a, &v) != (mp.count(a) != 0) || (mp.count(a) != 0 && mp[a] != v))
+            bad = true;
+        mp.erase(a);
+        if (i % 500 == 0){
+            b.maintain(10);
+            mp[a] = i;
+            b.addElem(a, i);
+        }
+    }
+    if (b.size() != mp.size())
+        bad = true;
+    if (b.maintain() == 0 || b.countUnderfull() != 0)
+        bad = true;
+
+    //keys of internal nodes are deleted by taking their successors from leaves
+    vector<int> seps;
+    for (int i = 0; i < 4000; i++)
+        if (mp.count(i) != 0 && b.rank(i) % 4 == 3)
+            seps.push_back(i);
+    for (size_t i = 0; i < seps.size(); i++){
+        mp.erase(seps[i]);
+        b.delElem(seps[i]);
+    }
+    if (b.countUnderfull() == 0)
+        bad = true;
+    b.maintain();
+    if (b.countUnderfull() != 0)
+        bad = true;
+    b.disableLazyDelete();
+    for (int i = 0; i < 4000; i += 3){
+        mp.erase(i);
+        b.delElem(i);
+    }
+    for (int i = 0; i < 4000; i++){
+        bool res = b.findElem(i, &v);
+        if (res != (mp.count(i) != 0) || (res && mp[i] != v))
+            bad = true;
+    }
+    unsigned long long j = 0;
+    for (map<int, int>::iterator it = mp.begin(); it != mp.end(); it++, j++){
+        int k;
+        if (!b.select(j, &k, &v) || k != it -> first || v != it -> second)
+            bad = true;
+    }
+    if (b.size() != mp.size())
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_lazy_delete_reopen(){
+    clear_tree();
+    map<int, int> mp;
+    bool bad = false;
+    {
+        Btree<int, int, 4> b;
+        for (int i = 0; i < 3000; i++){
+            int a = rand() % 4000;
+            mp[a] = i;
+            b.addElem(a, i);
+        }
+        b.enableLazyDelete();
+        for (int i = 0; i < 2000; i++){
+            int a = rand() % 4000;
+            mp.erase(a);
+            b.delElem(a);
+        }
+    }
+    Btree<int, int, 4> b; //delayed paths are lost, maintain walks whole tree
+    if (b.countUnderfull() == 0 || b.maintain() == 0 || b.countUnderfull() != 0 || b.maintain() != 0)
+        bad = true;
+    int v;
+    for (int i = 0; i < 4000; i++){
+        bool res = b.findElem(i, &v);
+        if (res != (mp.count(i) != 0) || (res && mp[i] != v))
+            bad = true;
+    }
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_append(){
+    unsigned long long sz[2];
+    bool bad = false;
+    for (int mode = 0; mode < 2; mode++){
+        clear_tree();
+        {
+            Btree<int, int, 8> b;
+            for (int i = 0; i < 6000; i += 2){
+                if (mode == 0){
+                    b.addElem(i, i);
+                    b.addElem(i + 1, i + 1);
+                }else{ //no increasing runs
+                    b.addElem(i + 1, i + 1);
+                    b.addElem(i, i);
+                }
+                if (i % 1000 == 0){
+                    b.delElem(i / 2);
+                    b.addElem(i / 2, i / 2);
+                }
+            }
+            int v, k;
+            for (int i = 0; i < 6000; i++)
+                if (!b.findElem(i, &v) || v != i)
+                    bad = true;
+            if (b.size() != 6000 || !b.select(4321, &k, &v) || k != 4321 || b.count(100, 199) != 100)
+                bad = true;
+            //right nodes left with few keys by appends are fixed when run ends
+            b.addElem(0, 0);
+            if (b.countUnderfull() != 0)
+                bad = true;
+            for (int i = 6000; i < 6100; i++)
+                b.addElem(i, i);
+        }
+        if (Btree<int, int, 8>().countUnderfull() != 0) //also when tree is closed
+            bad = true;
+        fstream f("btree.main", std::fstream::in | std::fstream::binary);
+        f.seekg(0, ios_base::end);
+        sz[mode] = f.tellg();
+    }
+    if (sz[0] * 3 / 2 > sz[1])
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_write_back(){
+    bool bad = false;
+    {
+        fstream f("btree.tmp", std::fstream::out | ios_base::trunc);
+    }
+    {
+        WriteBack w("btree.tmp");
+        char a[64], b[64];
+        for (int i = 0; i < 64; i++)
+            a[i] = i;
+        w.write(32, a + 32, 16);
+        w.write(0, a, 8);
+        w.write(8, a + 8, 24);
+        w.write(40, a + 40, 24); //overlaps first one
+        w.read(0, b, 64);
+        if (memcmp(a, b, 64) != 0 || w.end() != 64)
+            bad = true;
+        w.write(128, a, 8);
+        if (!w.commit() || w.syscalls != 2)
+            bad = true;
+        w.read(0, b, 64);
+        if (memcmp(a, b, 64) != 0 || w.end() != 136)
+            bad = true;
+    }
+    remove("btree.tmp");
+
+    clear_tree();
+    map<int, int> mp;
+    for (int round = 0; round < 3; round++){
+        Btree<int, int, 3> b;
+        int v;
+        for (map<int, int>::iterator it = mp.begin(); it != mp.end(); it++)
+            if (!b.findElem(it -> first, &v) || v != it -> second)
+                bad = true;
+        for (int i = 0; i < 1500; i++){
+            int a = rand() % 1000;
+            if (rand() % 3 == 0){
+                mp.erase(a);
+                b.delElem(a);
+            }else{
+                mp[a] = rand();
+                b.addElem(a, mp[a]);
+            }
+        }
+        if (b.size() != mp.size())
+            bad = true;
+    }
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+unsigned long long write_calls(){ //of this process, 0 if not known
+    ifstream f("/proc/self/io");
+    string name;
+    unsigned long long v;
+    while (f >> name >> v)
+        if (name == "syscw:")
+            return v;
+    return 0;
+}
+
+void test_log(){
+    clear_tree();
+    bool bad = false;
+    map<int, int> mp;
+    {
+        Btree<int, int, 50> b;
+        //records of insert go to log with one write, then its pages and cleared log count
+        unsigned long long before = write_calls();
+        for (int i = 0; i < 1000; i++){
+            int a = rand() % 100000;
+            mp[a] = i;
+            b.addElem(a, i);
+        }
+        if (write_calls() - before > 5 * 1000)
+            bad = true;
+    }
+
+    //pages of operation were written, but log wasn't cleared
+    vector<char> image;
+    {
+        ifstream f("btree.main", ios::in | ios::binary);
+        image.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+        Logger l("btree.log");
+        l.init();
+        l.log(0, &image[0], image.size(), 0);
+        l.flush();
+    }
+    {
+        fstream f("btree.main", ios::in | ios::out | ios::binary);
+        vector<char> zero(image.size(), 0);
+        f.write(&zero[0], zero.size());
+    }
+    {
+        Btree<int, int, 50> b;
+        int v;
+        for (map<int, int>::iterator it = mp.begin(); it != mp.end(); it++)
+            if (!b.findElem(it -> first, &v) || v != it -> second)
+                bad = true;
+    }
+    ifstream l("btree.log", ios::in | ios::binary);
+    unsigned long long cnt = 1;
+    l.read((char*)&cnt, sizeof(cnt));
+    if (cnt != 0)
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_hash_index(){
+    clear_tree();
+    map<int, int> mp;
+    bool bad = false;
+    for (int round = 0; round < 3; round++){
+        Btree<int, int, 3> b;
+        if (round == 0){
+            for (int i = 0; i < 2000; i++){
+                mp[i * 7] = i;
+                b.addElem(i * 7, i);
+            }
+            b.enableHashIndex();
+        }
+        if (round == 2){ //changes while disabled must not be lost on next enable
+            b.disableHashIndex();
+            b.delElem(mp.begin() -> first);
+            mp.erase(mp.begin());
+            b.enableHashIndex();
+        }
+        for (int i = 0; i < 3000; i++){
+            int a = rand() % 20000, v;
+            if (i % 500 == 0){
+                mp.erase(mp.lower_bound(a), mp.upper_bound(a + 300));
+                b.delRange(a, a + 300);
+            }else if (rand() % 3 == 0){
+                if (b.take(a, &v) != (mp.count(a) != 0) || (mp.count(a) && mp[a] != v))
+                    bad = true;
+                mp.erase(a);
+            }else{
+                mp[a] = i;
+                b.addElem(a, i);
+            }
+        }
+        for (int i = 0; i < 20000; i++){
+            int v;
+            bool res = b.findElem(i, &v);
+            if (res != (mp.count(i) != 0) || (res && mp[i] != v))
+                bad = true;
+        }
+    }
+
+    //padding bytes of keys are not hashed
+    clear_tree();
+    Btree<pair<char, long long>, int, 3> b;
+    b.enableHashIndex();
+    for (int i = 0; i < 1000; i++){
+        pair<char, long long> k;
+        memset((void*)&k, i, sizeof(k));
+        k.first = i % 7;
+        k.second = i;
+        b.addElem(k, i);
+    }
+    for (int i = 0; i < 1000; i++){
+        pair<char, long long> k;
+        memset((void*)&k, 255 - i % 256, sizeof(k));
+        k.first = i % 7;
+        k.second = i;
+        int v;
+        if (!b.findElem(k, &v) || v != i)
+            bad = true;
+    }
+
+    //tree never given hash index works without btree.hash
+    clear_tree();
+    remove("btree.hash");
+    {
+        Btree<int, int, 3> c;
+        for (int i = 0; i < 100; i++)
+            c.addElem(i, i);
+        c.delElem(0);
+        if (c.size() != 99)
+            bad = true;
+    }
+    if (ifstream("btree.hash"))
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_limited_scan(){
+    bool bad = false;
+    for (int mode = 0; mode < 2; mode++){
+        clear_tree();
+        Btree<int, int, 3> b;
+        map<int, int> mp;
+        for (int i = 0; i < 3000; i++){
+            int a = rand() % 5000;
+            mp[a] = i;
+            b.addElem(a, i);
+        }
+        if (mode == 1){ //part of changes only in buffer
+            b.enableWriteBuffer(1000);
+            for (int i = 0; i < 300; i++){
+                int a = rand() % 5000;
+                if (rand() % 2){
+                    mp.erase(a);
+                    b.delElem(a);
+                }else{
+                    mp[a] = -i;
+                    b.addElem(a, -i);
+                }
+            }
+        }
+        for (int i = 0; i < 100; i++){
+            int l = rand() % 5000, r = l + rand() % 2000;
+            size_t limit = rand() % 60;
+            bool reverse = (i % 2 == 1);
+            vector<pair<int, int> > exp, got;
+            vector<int> keys;
+            if (!reverse){
+                for (map<int, int>::iterator it = mp.lower_bound(l); it != mp.upper_bound(r) && (limit == 0 || exp.size() < limit); it++)
+                    exp.emplace_back(*it);
+            }else{
+                for (map<int, int>::reverse_iterator it(mp.upper_bound(r)); it != map<int, int>::reverse_iterator(mp.lower_bound(l)) && (limit == 0 || exp.size() < limit); it++)
+                    exp.emplace_back(*it);
+            }
+            b.getElems(l, r, got, limit, reverse);
+            b.getKeys(l, r, keys, limit, reverse);
+            if (got != exp || keys.size() != exp.size())
+                bad = true;
+            for (size_t j = 0; j < keys.size() && j < exp.size(); j++)
+                if (keys[j] != exp[j].first)
+                    bad = true;
+        }
+        //tree is read only up to limit, however many keys are buffered
+        unsigned long long h[2], m[2];
+        vector<pair<int, int> > few;
+        b.valueCacheStats(&h[0], &m[0]);
+        b.getElems(0, 5000, few, 5);
+        b.valueCacheStats(&h[1], &m[1]);
+        if (few.size() != 5 || h[1] + m[1] - h[0] - m[0] > 5)
+            bad = true;
+    }
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_database(){
+    remove("test.main");
+    remove("test.vals");
+    remove("test.log");
+    remove("test.buffered.wal");
+    bool bad = false;
+    map<int, int> mp;
+    map<pair<int, int>, long long> by_val;
+    {
+        Database db("test");
+        Btree<int, int, 3> a(db, "primary");
+        Btree<pair<int, int>, long long, 5> b(db, "by_value");
+        for (int i = 0; i < 2000; i++){
+            int k = rand() % 3000, v = rand() % 100;
+            db.begin(); //both indexes or none
+            int old;
+            if (a.findElem(k, &old))
+                b.delElem(make_pair(old, k));
+            a.addElem(k, v);
+            b.addElem(make_pair(v, k), k);
+            db.commit();
+            if (mp.count(k))
+                by_val.erase(make_pair(mp[k], k));
+            mp[k] = v;
+            by_val[make_pair(v, k)] = k;
+        }
+        try{
+            Btree<long long, int, 3> c(db, "primary");
+            bad = true;
+        }catch (std::exception &e){}
+    }
+    {
+        Database db("test");
+        Btree<int, int, 3> a(db, "primary");
+        Btree<pair<int, int>, long long, 5> b(db, "by_value");
+        db.begin(); //never committed
+        for (int i = 0; i < 500; i++){
+            a.delElem(i);
+            b.addElem(make_pair(-1, i), i);
+        }
+    }
+    {
+        Database db("test");
+        Btree<pair<int, int>, long long, 5> b(db, "by_value");
+        Btree<int, int, 3> a(db, "primary");
+        if (a.size() != mp.size() || b.size() != by_val.size())
+            bad = true;
+        vector<pair<int, int> > got;
+        a.getElems(0, 3000, got);
+        if (got != vector<pair<int, int> >(mp.begin(), mp.end()))
+            bad = true;
+        vector<pair<pair<int, int>, long long> > got_b;
+        b.getElems(make_pair(10, 0), make_pair(20, 0), got_b, 30);
+        map<pair<int, int>, long long>::iterator it = by_val.lower_bound(make_pair(10, 0));
+        for (size_t i = 0; i < got_b.size(); i++, it++)
+            if (got_b[i].first != it -> first || got_b[i].second != it -> second)
+                bad = true;
+        if (got_b.size() != 30)
+            bad = true;
+    }
+    {
+        Database db("test");
+        Btree<int, int, 3> a(db, "primary");
+        Btree<pair<int, int>, long long, 5> b(db, "by_value");
+        Btree<int, int, 4> c(db, "buffered");
+        c.enableWriteBuffer(50);
+        for (int i = 0; i < 30; i++)
+            c.addElem(i, i);
+        db.begin();
+        try{
+            Btree<int, int, 3> d(db, "new");
+            bad = true;
+        }catch (std::exception &e){}
+        for (int i = 0; i < 1000; i++){
+            a.delElem(i);
+            b.addElem(make_pair(-1, i), i);
+        }
+        for (int i = 30; i < 60; i++) //buffer is skipped inside transaction
+            c.addElem(i, i);
+        db.abort(); //trees are as before begin, entries buffered before it stay
+        if (a.size() != mp.size() || b.size() != by_val.size() || c.size() != 30)
+            bad = true;
+        c.addElem(60, 60); //buffered again after transaction
+        db.begin();
+        a.addElem(-5, 5);
+        b.addElem(make_pair(5, -5), -5);
+        db.commit();
+        mp[-5] = 5;
+        by_val[make_pair(5, -5)] = -5;
+    }
+    {
+        Database db("test");
+        Btree<int, int, 3> a(db, "primary");
+        Btree<pair<int, int>, long long, 5> b(db, "by_value");
+        Btree<int, int, 4> c(db, "buffered");
+        vector<pair<int, int> > got;
+        a.getElems(-10, 3000, got);
+        if (got != vector<pair<int, int> >(mp.begin(), mp.end()) || b.size() != by_val.size() || c.size() != 31)
+            bad = true;
+    }
+    remove("test.main");
+    remove("test.vals");
+    remove("test.log");
+    remove("test.buffered.wal");
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_format(){
+    clear_tree();
+    bool bad = false;
+    {
+        fstream f("btree.main", std::fstream::out | std::fstream::binary | ios_base::trunc);
+        unsigned long long old[2] = {0, 0}; //free list head and root of file without catalog
+        f.write((char*)old, sizeof(old));
+    }
+    try{
+        Btree<int, int, 3> b;
+        bad = true;
+    }catch (std::exception &e){}
+
+    clear_tree();
+    {
+        Btree<int, int, 3> b;
+        b.addElem(1, 1);
+    }
+    {
+        fstream f("btree.main", std::fstream::in | std::fstream::out | std::fstream::binary);
+        unsigned long long version = 1000;
+        f.seekp(sizeof(unsigned long long), ios_base::beg);
+        f.write((char*)&version, sizeof(version));
+    }
+    try{
+        Btree<int, int, 3> b;
+        bad = true;
+    }catch (std::exception &e){}
+    clear_tree();
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
+void test_buffer_reads(){
+    clear_tree();
+    bool bad = false;
+    map<int, int> mp;
+    {
+        fstream wal("btree.wal", std::fstream::out | std::fstream::binary | ios_base::trunc); //left by crashed session
+        for (int i = 0; i < 10; i++){
+            char live = 1;
+            int k = i * 10, v = i;
+            wal.write(&live, 1);
+            wal.write((char*)&k, sizeof(int));
+            wal.write((char*)&v, sizeof(int));
+            mp[k] = v;
+        }
+    }
+    Btree<int, int, 3, SumAggregate<int> > b; //replays wal without enableWriteBuffer
+    int v, k;
+    for (int i = 0; i < 100; i++)
+        if (b.findElem(i, &v) != (mp.count(i) != 0) || (mp.count(i) && mp[i] != v))
+            bad = true;
+    for (int i = 0; i < 2000; i++){
+        int a = rand() % 3000;
+        mp[a] = i;
+        b.addElem(a, i);
+    }
+
+    b.enableWriteBuffer(100000);
+    const size_t rec = 1 + 2 * sizeof(int);
+    size_t ops = 0;
+    for (int i = 0; i < 1000; i++){
+        int a = rand() % 3000;
+        if (rand() % 3 == 0){
+            bool res = b.take(a, &v);
+            if (res != (mp.count(a) != 0) || (res && mp[a] != v))
+                bad = true;
+            ops += res;
+            mp.erase(a);
+        }else{
+            b.upsert(a, [](int &x, bool exists){ x = (exists ? x + 1 : 1); });
+            mp[a]++;
+            ops++;
+        }
+        if (i % 100 == 0){
+            int l = rand() % 3000, r = l + rand() % 500, sum = 0;
+            for (map<int, int>::iterator it = mp.lower_bound(l); it != mp.upper_bound(r); it++)
+                sum += it -> second;
+            unsigned long long j = rand() % mp.size();
+            map<int, int>::iterator it = mp.begin();
+            advance(it, j);
+            if (b.size() != mp.size() || b.count(l, r) != (unsigned long long)distance(mp.lower_bound(l), mp.upper_bound(r)))
+                bad = true;
+            if (b.rank(l) != (unsigned long long)distance(mp.begin(), mp.lower_bound(l)) || b.aggregate(l, r) != sum)
+                bad = true;
+            if (!b.select(j, &k, &v) || k != it -> first || v != it -> second || b.select(mp.size(), &k, &v))
+                bad = true;
+        }
+    }
+    fstream wal("btree.wal", std::fstream::in | std::fstream::binary); //nothing was flushed
+    wal.seekg(0, ios_base::end);
+    if ((size_t)wal.tellg() != ops * rec)
+        bad = true;
+    if (bad)
+        FAIL;
+    SUCCESS;
+}
+
 void test_all(){
     test_one_elem();
     test_find();
@@ -214,6 +1286,25 @@ void test_all(){
     test_del();
     test_reuse();
     test_complex_class();
+    test_filter();
+    test_read_modify_write();
+    test_order_statistics();
+    test_counts();
+    test_del_range();
+    test_frozen();
+    test_write_buffer();
+    test_buffer_reads();
+    test_be_tree();
+    test_value_cache();
+    test_lazy_delete();
+    test_lazy_delete_reopen();
+    test_append();
+    test_write_back();
+    test_log();
+    test_hash_index();
+    test_limited_scan();
+    test_database();
+    test_format();
 }
 
 int main(){
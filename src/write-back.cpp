@@ -0,0 +1,128 @@
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include "write-back.h"
+
+using namespace std;
+
+WriteBack::WriteBack(const char *name):syscalls(0){
+    fd = open(name, O_RDWR | O_CREAT, 0644);
+    ok = (fd >= 0);
+}
+
+WriteBack::~WriteBack(){
+    if (fd >= 0)
+        close(fd);
+}
+
+void WriteBack::read(unsigned long long offset, char *buf, size_t len){
+    size_t done = 0;
+    while (ok && done < len){
+        ssize_t r = pread(fd, buf + done, len - done, offset + done);
+        if (r < 0)
+            ok = false;
+        if (r <= 0)
+            break;
+        done += r;
+    }
+    memset(buf + done, 0, len - done);
+
+    unsigned long long last = offset + len;
+    map<unsigned long long, vector<char> >::iterator it = dirty.upper_bound(offset);
+    if (it != dirty.begin())
+        it--;
+    for (; it != dirty.end() && it -> first < last; it++){
+        unsigned long long l = max(offset, it -> first), r = min(last, it -> first + it -> second.size());
+        if (l < r)
+            memcpy(buf + (l - offset), &it -> second[l - it -> first], r - l);
+    }
+}
+
+void WriteBack::write(unsigned long long offset, const char *buf, size_t len){
+    unsigned long long l = offset, r = offset + len;
+    map<unsigned long long, vector<char> >::iterator it = dirty.upper_bound(offset);
+    if (it != dirty.begin()){
+        it--;
+        if (it -> first + it -> second.size() <= offset)
+            it++;
+    }
+    if (it != dirty.end() && it -> first == offset && it -> second.size() >= len){ //same page again
+        memcpy(&it -> second[0], buf, len);
+        return;
+    }
+
+    map<unsigned long long, vector<char> >::iterator from = it; //ranges overlapping new one are merged in it
+    for (; it != dirty.end() && it -> first < offset + len; it++){
+        l = min(l, it -> first);
+        r = max(r, it -> first + it -> second.size());
+    }
+    vector<char> joined(r - l);
+    for (map<unsigned long long, vector<char> >::iterator i = from; i != it; i++)
+        memcpy(&joined[i -> first - l], &i -> second[0], i -> second.size());
+    memcpy(&joined[offset - l], buf, len);
+    dirty.erase(from, it);
+    dirty[l].swap(joined);
+}
+
+unsigned long long WriteBack::end(){
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        ok = false;
+        return 0;
+    }
+    unsigned long long res = st.st_size;
+    if (!dirty.empty())
+        res = max(res, dirty.rbegin() -> first + dirty.rbegin() -> second.size());
+    return res;
+}
+
+bool WriteBack::commit(){
+    map<unsigned long long, vector<char> >::iterator it = dirty.begin();
+    while (ok && it != dirty.end()){
+        unsigned long long start = it -> first, len = 0;
+        vector<iovec> parts;
+        for (; it != dirty.end() && it -> first == start + len && parts.size() < IOV_MAX; it++){
+            iovec v = {&it -> second[0], it -> second.size()};
+            parts.emplace_back(v);
+            len += it -> second.size();
+        }
+
+        size_t part = 0;
+        while (ok && len != 0){
+            ssize_t w = pwritev(fd, &parts[part], parts.size() - part, start);
+            syscalls++;
+            if (w <= 0){
+                ok = false;
+                break;
+            }
+            start += w;
+            len -= w;
+            while (part < parts.size() && (size_t)w >= parts[part].iov_len){
+                w -= parts[part].iov_len;
+                part++;
+            }
+            if (part < parts.size()){ //short write
+                parts[part].iov_base = (char*)parts[part].iov_base + w;
+                parts[part].iov_len -= w;
+            }
+        }
+    }
+    dirty.clear();
+    return ok;
+}
+
+bool WriteBack::pending(){
+    return !dirty.empty();
+}
+
+void WriteBack::discard(){
+    dirty.clear();
+}
+
+bool WriteBack::good(){
+    return ok;
+}